@@ -0,0 +1,41 @@
+#include "popen3.hpp"
+#include <vector>
+#include <string>
+#include <cstdio>
+
+// Feed a large input while the child writes to both stdout and stderr.
+// A sequential write-then-read would deadlock once the pipes fill up;
+// communicate() pumps all three streams at once.
+int main() {
+    using namespace tinyproc;
+
+    popen3::options opt;
+    opt.in  = popen3::stream_spec::pipe();
+    opt.out = popen3::stream_spec::pipe();
+    opt.err = popen3::stream_spec::pipe();
+
+    std::vector<std::string> argv;
+    argv.push_back("sh");
+    argv.push_back("-c");
+    argv.push_back("tee /dev/stderr | wc -c");
+
+    popen3 proc;
+    if (!proc.start(argv, opt)) {
+        std::fprintf(stderr, "start: %s\n", proc.last_error().c_str());
+        return 1;
+    }
+
+    std::string input(4 * 1024 * 1024, 'x');
+    std::string out, err;
+    popen3::communicate_result res;
+    if (!proc.communicate(input.data(), input.size(), &out, &err, 10000, &res)) {
+        std::fprintf(stderr, "communicate: %s\n", proc.last_error().c_str());
+        return 1;
+    }
+
+    std::printf("exit=%d in=%lu out=%lu err=%lu stdout: %s",
+                WIFEXITED(res.status) ? WEXITSTATUS(res.status) : -1,
+                (unsigned long)res.bytes_in, (unsigned long)res.bytes_out,
+                (unsigned long)res.bytes_err, out.c_str());
+    return 0;
+}
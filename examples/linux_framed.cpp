@@ -0,0 +1,86 @@
+#include "popen3.hpp"
+#include "popen3_frame.h"
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+// Request/response over length-prefixed frames. The program runs itself as
+// the helper child ("--child"), which uses the C header popen3_frame.h to
+// answer every frame with its reversed payload.
+static int child_main() {
+    tpf_reader r;
+    const char* req;
+    size_t len;
+    std::vector<char> reply;
+    tpf_reader_init(&r, 0, TPF_VARINT, 1 << 26);
+    while (tpf_read(&r, &req, &len) == 1) {
+        reply.assign(req, req + len);
+        for (size_t i = 0; i < len / 2; ++i) std::swap(reply[i], reply[len - 1 - i]);
+        if (tpf_write(1, TPF_VARINT, len ? &reply[0] : "", len) != 0) break;
+    }
+    tpf_reader_free(&r);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    using namespace tinyproc;
+    if (argc > 1 && std::strcmp(argv[1], "--child") == 0) return child_main();
+
+    popen3::options opt;
+    opt.in  = popen3::stream_spec::pipe();
+    opt.out = popen3::stream_spec::pipe();
+
+    std::vector<std::string> args;
+    args.push_back("/proc/self/exe");
+    args.push_back("--child");
+
+    popen3 proc;
+    if (!proc.start(args, opt)) {
+        std::fprintf(stderr, "start: %s\n", proc.last_error().c_str());
+        return 1;
+    }
+
+    framed_channel ch(proc, framed_channel::VARINT);
+
+    // Pipelined: queue many frames (written in batches), then read the replies
+    const int n = 1000;
+    for (int i = 0; i < n; ++i) {
+        char msg[32];
+        int len = std::snprintf(msg, sizeof(msg), "message %d", i);
+        if (!ch.send(msg, (size_t)len)) {
+            std::fprintf(stderr, "%s\n", ch.last_error().c_str());
+            return 1;
+        }
+    }
+    ch.flush();
+
+    int ok = 0;
+    for (int i = 0; i < n; ++i) {
+        const char* resp;
+        size_t len;
+        if (!ch.recv(&resp, &len)) {
+            std::fprintf(stderr, "recv: %s\n", ch.last_error().c_str());
+            return 1;
+        }
+        if (i == n - 1) std::printf("last reply: %.*s\n", (int)len, resp);
+        ++ok;
+    }
+
+    // One large request/response round trip (payload written without a copy)
+    std::string big(1 << 20, 'x');
+    big[0] = 'A';
+    const char* resp;
+    size_t len;
+    if (!ch.call(big.data(), big.size(), &resp, &len)) {
+        std::fprintf(stderr, "call: %s\n", ch.last_error().c_str());
+        return 1;
+    }
+
+    proc.close_stdin();
+    int status = 0;
+    proc.wait(&status, 0);
+    std::printf("replies=%d big=%lu last_byte=%c exit=%d\n", ok, (unsigned long)len, resp[len - 1],
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+}
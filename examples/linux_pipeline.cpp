@@ -0,0 +1,45 @@
+#include "popen3.hpp"
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+// Equivalent of: printf '...' | sort | uniq -c
+// The bytes flow child to child; we only feed the first stage and read the last.
+int main() {
+    using namespace tinyproc;
+
+    pipeline pl;
+    std::vector<std::string> sort_argv;
+    sort_argv.push_back("sort");
+    std::vector<std::string> uniq_argv;
+    uniq_argv.push_back("uniq");
+    uniq_argv.push_back("-c");
+
+    popen3::options first;
+    first.in = popen3::stream_spec::pipe();
+    popen3::options last;
+    last.out = popen3::stream_spec::pipe();
+    pl.add(sort_argv, first);
+    pl.add(uniq_argv, last);
+
+    if (!pl.start()) {
+        std::fprintf(stderr, "pipeline: %s\n", pl.last_error().c_str());
+        return 1;
+    }
+
+    const char* words = "pear\napple\npear\nfig\napple\npear\n";
+    pl.write_stdin(words, std::strlen(words));
+    pl.close_stdin();
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = pl.read_stdout(buf, sizeof(buf))) > 0) std::fwrite(buf, 1, (size_t)n, stdout);
+
+    std::vector<int> statuses;
+    pl.wait(&statuses);
+    for (size_t i = 0; i < statuses.size(); ++i)
+        std::printf("stage %u exited with %d\n", (unsigned)i,
+                    WIFEXITED(statuses[i]) ? WEXITSTATUS(statuses[i]) : -1);
+    return 0;
+}
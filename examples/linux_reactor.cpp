@@ -0,0 +1,57 @@
+#include "popen3.hpp"
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+// Run many short-lived children concurrently on a single event loop and
+// count what they print. Pass "io_uring" to use that backend instead of epoll.
+class counter : public tinyproc::reactor_handler {
+public:
+    counter() : bytes(0), lines(0), exits(0), failures(0) {}
+
+    virtual void on_stdout(tinyproc::popen3&, const char* data, size_t len) {
+        bytes += len;
+        for (size_t i = 0; i < len; ++i) if (data[i] == '\n') ++lines;
+    }
+
+    virtual void on_exit(tinyproc::popen3&, int status) {
+        ++exits;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ++failures;
+    }
+
+    unsigned long bytes, lines, exits, failures;
+};
+
+int main(int argc, char** argv) {
+    using namespace tinyproc;
+
+    popen3::options opt;
+    opt.out = popen3::stream_spec::pipe();
+
+    // io_uring falls back to epoll on kernels that lack it
+    bool uring = (argc > 1 && std::strcmp(argv[1], "io_uring") == 0);
+    reactor loop(16, uring ? reactor::BACKEND_IO_URING : reactor::BACKEND_EPOLL);
+    if (!loop.ok()) {
+        std::fprintf(stderr, "reactor: %s\n", loop.last_error().c_str());
+        return 1;
+    }
+
+    counter c;
+    for (int i = 0; i < 200; ++i) {
+        std::vector<std::string> argv;
+        argv.push_back("seq");
+        argv.push_back("1000");
+        if (!loop.spawn(argv, opt, &c)) {
+            std::fprintf(stderr, "spawn: %s\n", loop.last_error().c_str());
+            return 1;
+        }
+    }
+
+    loop.run();
+
+    std::printf("backend=%s children=%lu failures=%lu lines=%lu bytes=%lu\n",
+                loop.backend() == reactor::BACKEND_IO_URING ? "io_uring" : "epoll",
+                c.exits, c.failures, c.lines, c.bytes);
+    return 0;
+}
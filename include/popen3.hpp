@@ -10,6 +10,8 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <istream>
+#include <ostream>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -58,7 +60,8 @@ public:
           h_stdin_w_(NULL), h_stdout_r_(NULL), h_stderr_r_(NULL),
           parent_nonblock_(false), overlapped_(false),
           io_buf_size_(0),
-          last_err_(0)
+          last_err_(0),
+          in_stream_(NULL), out_stream_(NULL), err_stream_(NULL)
     {
         init_ov_read(out_rd_);
         init_ov_read(err_rd_);
@@ -71,6 +74,9 @@ public:
         close_stdin();
         close_stdout();
         close_stderr();
+        delete in_stream_;
+        delete out_stream_;
+        delete err_stream_;
         if (th_)   { CloseHandle(th_);   th_   = NULL; }
         if (proc_) { CloseHandle(proc_); proc_ = NULL; }
         if (out_rd_.evt) CloseHandle(out_rd_.evt);
@@ -312,8 +318,15 @@ public:
         return read_sync_(h_stderr_r_, buf, len, "stderr");
     }
 
-    // Close streams
-    void close_stdin()  { close_and_reset_write_(in_wr_, h_stdin_w_);  }
+    // iostream adapters over the pipes, for synchronous (non-overlapped,
+    // blocking) use. buffer_size takes effect when the stream is first
+    // created (0: 64 KiB). Defined after the platform sections.
+    std::ostream& stdin_stream(size_t buffer_size = 0);
+    std::istream& stdout_stream(size_t buffer_size = 0);
+    std::istream& stderr_stream(size_t buffer_size = 0);
+
+    // Close streams (stdin_stream() is flushed first)
+    void close_stdin()  { if (in_stream_) in_stream_->flush(); close_and_reset_write_(in_wr_, h_stdin_w_);  }
     void close_stdout() { close_and_reset_read_(out_rd_, h_stdout_r_); }
     void close_stderr() { close_and_reset_read_(err_rd_, h_stderr_r_); }
 
@@ -379,6 +392,10 @@ private:
     DWORD last_err_;
     std::string last_msg_;
 
+    std::ostream* in_stream_;
+    std::istream* out_stream_;
+    std::istream* err_stream_;
+
     struct ov_read_t {
         HANDLE h;        // Parent read handle
         OVERLAPPED ov;
@@ -753,27 +770,325 @@ private:
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
+#include <stdint.h>
+
+#include <map>
+#include <algorithm>
+#include <istream>
+#include <ostream>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#if __cplusplus >= 201703L
+#  include <string_view>
+#endif
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#  include <sched.h>
+#  include <sys/syscall.h>
+#  include <sys/sendfile.h>
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#endif
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+// SSE2 delimiter search; AVX2 is picked at run time (target attribute)
+#  include <immintrin.h>
+#  define TINYPROC_HAS_X86_SIMD 1
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+// posix_spawn_file_actions_addchdir_np, and adddup2(fd, fd) clears FD_CLOEXEC
+#  define TINYPROC_HAS_SPAWN_CHDIR 1
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+// posix_spawn_file_actions_addclosefrom_np
+#  define TINYPROC_HAS_SPAWN_CLOSEFROM 1
+#endif
+#if defined(__linux__) && !defined(CLOSE_RANGE_CLOEXEC)
+#  define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+extern char** environ;
 
 namespace tinyproc {
 
+class spawn_server;
+
+// Caches command-name lookups across spawns (popen3::options::resolver).
+// An entry is reused only while the executable and every PATH directory probed
+// before it keep their device/inode/mtime, so a binary installed earlier in
+// PATH still shadows the cached one. With keep_fds, each entry also holds an
+// open descriptor of the binary and the child execs it directly
+// (execveat(AT_EMPTY_PATH) / fexecve), skipping path resolution altogether.
+// Relative names and relative PATH entries are never cached. Thread-safe.
+class exec_resolver {
+public:
+    explicit exec_resolver(bool keep_fds = false) : keep_fds_(keep_fds) { ::pthread_mutex_init(&mu_, 0); }
+    ~exec_resolver() { clear(); ::pthread_mutex_destroy(&mu_); }
+
+    // Look name up in path (a $PATH value; NULL means "/bin:/usr/bin").
+    // On success stores the executable's path in resolved and, when fd is non-NULL,
+    // a CLOEXEC duplicate of the cached descriptor (or -1) that the caller must close.
+    bool resolve(const char* name, const char* path, std::string& resolved, int* fd = 0) {
+        if (fd) *fd = -1;
+        std::string key(name);
+        key.push_back('\0');
+        if (path) key += path;
+
+        ::pthread_mutex_lock(&mu_);
+        std::map<std::string, entry_>::iterator it = entries_.find(key);
+        if (it != entries_.end() && !still_valid_(it->second)) {
+            drop_(it->second);
+            entries_.erase(it);
+            it = entries_.end();
+        }
+        if (it == entries_.end()) {
+            entry_ e;
+            if (!lookup_(name, path, e)) { ::pthread_mutex_unlock(&mu_); return false; }
+            it = entries_.insert(std::make_pair(key, e)).first;
+        }
+        resolved = it->second.file;
+        if (fd && it->second.fd != -1) *fd = ::fcntl(it->second.fd, F_DUPFD_CLOEXEC, 3);
+        ::pthread_mutex_unlock(&mu_);
+        return true;
+    }
+
+    // Forget every entry (and close the cached descriptors)
+    void clear() {
+        ::pthread_mutex_lock(&mu_);
+        for (std::map<std::string, entry_>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+            drop_(it->second);
+        entries_.clear();
+        ::pthread_mutex_unlock(&mu_);
+    }
+
+private:
+    struct stamp_ {
+        bool exists;
+        dev_t dev;
+        ino_t ino;
+        time_t mtime;
+        long mtime_ns;
+    };
+    struct entry_ {
+        std::string file;
+        stamp_ file_stamp;
+        std::vector<std::string> dirs;   // PATH entries probed before the hit
+        std::vector<stamp_> dir_stamps;
+        int fd;
+        entry_() : fd(-1) {}
+    };
+
+    bool keep_fds_;
+    pthread_mutex_t mu_;
+    std::map<std::string, entry_> entries_;
+
+    exec_resolver(const exec_resolver&);
+    exec_resolver& operator=(const exec_resolver&);
+
+    static stamp_ stamp_from_(const struct stat& st) {
+        stamp_ s;
+        s.exists = true;
+        s.dev = st.st_dev;
+        s.ino = st.st_ino;
+        s.mtime = st.st_mtime;
+#if defined(__linux__)
+        s.mtime_ns = st.st_mtim.tv_nsec;
+#else
+        s.mtime_ns = 0;
+#endif
+        return s;
+    }
+    static stamp_ stamp_of_(const char* p) {
+        struct stat st;
+        if (::stat(p, &st) != 0) { stamp_ s; std::memset(&s, 0, sizeof(s)); return s; }
+        return stamp_from_(st);
+    }
+    static bool same_(const stamp_& a, const stamp_& b) {
+        if (a.exists != b.exists) return false;
+        return !a.exists || (a.dev == b.dev && a.ino == b.ino && a.mtime == b.mtime && a.mtime_ns == b.mtime_ns);
+    }
+
+    bool still_valid_(const entry_& e) const {
+        for (size_t i = 0; i < e.dirs.size(); ++i)
+            if (!same_(stamp_of_(e.dirs[i].c_str()), e.dir_stamps[i])) return false;
+        return same_(stamp_of_(e.file.c_str()), e.file_stamp);
+    }
+
+    bool lookup_(const char* name, const char* path, entry_& e) const {
+        if (std::strchr(name, '/')) return name[0] == '/' && probe_(name, e);
+        if (!path) path = "/bin:/usr/bin";
+        for (const char* p = path; ; ) {
+            const char* end = std::strchr(p, ':');
+            std::string dir = end ? std::string(p, end - p) : std::string(p);
+            if (dir.empty() || dir[0] != '/') return false; // Depends on the child's cwd
+            if (probe_((dir + "/" + name).c_str(), e)) return true;
+            e.dirs.push_back(dir);
+            e.dir_stamps.push_back(stamp_of_(dir.c_str()));
+            if (!end) return false;
+            p = end + 1;
+        }
+    }
+
+    // Same acceptance rule as execvp: an existing, executable regular file
+    bool probe_(const char* file, entry_& e) const {
+        struct stat st;
+        if (::stat(file, &st) != 0 || !S_ISREG(st.st_mode) || ::access(file, X_OK) != 0) return false;
+        e.file = file;
+        e.file_stamp = stamp_from_(st);
+        if (keep_fds_) {
+            int fd = open_exec_(file);
+            if (fd != -1) {
+                // Scripts cannot be run from a CLOEXEC descriptor (the interpreter
+                // could not reopen it), so those are exec'd by path
+                struct stat fst;
+                if (is_script_(fd)) {
+                    ::close(fd);
+                } else if (::fstat(fd, &fst) == 0) {
+                    e.file_stamp = stamp_from_(fst);
+                    e.fd = fd;
+                } else {
+                    ::close(fd);
+                }
+            }
+        }
+        return true;
+    }
+
+    // O_PATH needs no read permission, so execute-only binaries are pinned too
+    static int open_exec_(const char* file) {
+#if defined(__linux__) && defined(O_PATH)
+        int fd = ::open(file, O_PATH | O_CLOEXEC);
+        if (fd != -1) return fd;
+#endif
+        return ::open(file, O_RDONLY | O_CLOEXEC);
+    }
+
+    // Whether the file behind fd starts with "#!". An O_PATH descriptor cannot be
+    // read, so it is reopened through /proc; a file we cannot read is no script
+    // we could run anyway.
+    static bool is_script_(int fd) {
+        char magic[2] = { 0, 0 };
+        ssize_t n = ::pread(fd, magic, 2, 0);
+        if (n < 0 && errno == EBADF) {
+            char proc[64];
+            std::snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+            int rfd = ::open(proc, O_RDONLY | O_CLOEXEC);
+            if (rfd == -1) return false;
+            n = ::pread(rfd, magic, 2, 0);
+            ::close(rfd);
+        }
+        return n == 2 && magic[0] == '#' && magic[1] == '!';
+    }
+
+    static void drop_(entry_& e) {
+        if (e.fd != -1) { ::close(e.fd); e.fd = -1; }
+    }
+};
+
 class popen3 {
 public:
     struct stream_spec {
-        enum mode_t { INHERIT, PIPE, USE_FD } mode;
-        int fd; // only for USE_FD
-        stream_spec() : mode(INHERIT), fd(-1) {}
+        // MEMORY/MEMFD are read-only inputs (stdin, or an extra fd the child reads):
+        // the child gets a sealed, seekable, mmap-able file positioned at offset 0,
+        // and the parent has no write loop and no pipe to keep open
+        enum mode_t { INHERIT, PIPE, USE_FD, MEMORY, MEMFD } mode;
+        int fd; // only for USE_FD and MEMFD
+        // MEMORY only: copied into a memfd (an unlinked temp file where memfd_create
+        // is unavailable) by start(); the buffer need not outlive that call
+        const void* data;
+        size_t size;
+        // PIPE only (Linux): requested capacity in bytes, clamped to
+        // /proc/sys/fs/pipe-max-size (0: system default). With adaptive, a pipe the
+        // child writes into starts small (capacity, or 16 KiB), doubles while reads
+        // keep finding it full and halves again while they find it nearly empty
+        // (trim_pipes() shrinks it once the child goes quiet).
+        size_t capacity;
+        bool adaptive;
+        stream_spec() : mode(INHERIT), fd(-1), data(0), size(0), capacity(0), adaptive(false) {}
         static stream_spec inherit() { stream_spec s; s.mode = INHERIT; return s; }
-        static stream_spec pipe()    { stream_spec s; s.mode = PIPE;    return s; }
+        static stream_spec pipe(size_t capacity = 0, bool adaptive = false) {
+            stream_spec s; s.mode = PIPE; s.capacity = capacity; s.adaptive = adaptive; return s;
+        }
         static stream_spec use_fd(int child_fd_source) {
             stream_spec s; s.mode = USE_FD; s.fd = child_fd_source; return s;
         }
+        static stream_spec memory(const void* data, size_t size) {
+            stream_spec s; s.mode = MEMORY; s.data = data; s.size = size; return s;
+        }
+        // The child shares fd's file (dup'ed; fd stays the caller's). Where the kernel
+        // allows it the file is sealed against writes and resizing first, and it is
+        // rewound to offset 0 -- the offset is shared with fd.
+        static stream_spec memfd(int fd) {
+            stream_spec s; s.mode = MEMFD; s.fd = fd; return s;
+        }
+    };
+
+    // How the child is created
+    //   SPAWN_FORK        : fork() then exec (default; cost grows with the parent's page tables)
+    //   SPAWN_VFORK       : clone(CLONE_VM|CLONE_VFORK) on Linux, vfork() elsewhere; the parent is
+    //                       suspended until the child execs, and no page tables are copied
+    //   SPAWN_POSIX_SPAWN : posix_spawn/posix_spawnp with file actions; falls back to SPAWN_VFORK
+    //                       when the options cannot be expressed as file actions
+    enum spawn_backend_t { SPAWN_FORK, SPAWN_VFORK, SPAWN_POSIX_SPAWN };
+
+    // An additional child descriptor (options.extra_fds). A pipe's direction is
+    // given by child_writes; USE_FD installs the given descriptor as-is; MEMORY/MEMFD
+    // are read by the child.
+    struct extra_fd {
+        stream_spec spec;
+        bool child_writes;
+        extra_fd() : child_writes(true) {}
+        static extra_fd output() { extra_fd e; e.spec = stream_spec::pipe(); e.child_writes = true;  return e; }
+        static extra_fd input()  { extra_fd e; e.spec = stream_spec::pipe(); e.child_writes = false; return e; }
+        static extra_fd use_fd(int child_fd_source) { extra_fd e; e.spec = stream_spec::use_fd(child_fd_source); return e; }
+        static extra_fd input(const stream_spec& memory) { extra_fd e; e.spec = memory; e.child_writes = false; return e; }
+    };
+
+    // Cap on a child's output stream (options.out_limit / err_limit), enforced by
+    // read_stdout()/read_stderr() and everything built on them (readv_*, communicate(),
+    // the iostream adapters, line_reader, reactor with either backend, ...). Readers
+    // of the raw descriptor are not limited.
+    //   BACKPRESSURE : stop reading. Past max_bytes reads fail with ENOBUFS; over
+    //                  max_rate they sleep until the budget refills, or on a
+    //                  non-blocking pipe fail with EAGAIN (see stdout_limit_wait_ms()).
+    //                  The pipe fills and the child blocks in write().
+    //   TRUNCATE     : keep draining the pipe, but drop what exceeds a limit; past
+    //                  max_bytes every read discards until EOF.
+    //   KILL         : SIGKILL the child's process group when a limit is crossed (the
+    //                  child alone unless options.setpgid put it in one), then drain
+    //                  like TRUNCATE.
+    struct output_limit {
+        enum policy_t { BACKPRESSURE, TRUNCATE, KILL };
+        uint64_t max_bytes; // Bytes handed to the caller over the child's life, 0: unlimited
+        uint64_t max_rate;  // Bytes per second with a one-second burst, 0: unlimited
+        policy_t policy;
+        output_limit() : max_bytes(0), max_rate(0), policy(BACKPRESSURE) {}
+        output_limit(uint64_t bytes, uint64_t rate, policy_t p) : max_bytes(bytes), max_rate(rate), policy(p) {}
+    };
+
+    // What an output_limit did to its stream (stdout_limit_stats() / stderr_limit_stats())
+    struct output_limit_stats {
+        uint64_t delivered;    // Bytes returned to the caller
+        uint64_t discarded;    // Bytes drained and dropped (TRUNCATE, KILL)
+        uint64_t throttled_ns; // Time read_*() slept for the rate budget (BACKPRESSURE)
+        unsigned bytes_hits;   // Reads max_bytes refused or cut short
+        unsigned rate_hits;    // Reads max_rate delayed or cut short
+        bool killed;           // KILL fired
+        output_limit_stats() : delivered(0), discarded(0), throttled_ns(0), bytes_hits(0), rate_hits(0), killed(false) {}
     };
 
     struct options {
@@ -796,16 +1111,57 @@ public:
         bool setpgid;
         pid_t pgid; // 0 means use the child as the group leader
 
+        // Spawn primitive (see spawn_backend_t)
+        spawn_backend_t spawn_backend;
+
+        // Optional lookup cache for argv[0], shared across spawns (not owned)
+        exec_resolver* resolver;
+
+        // Exec this already-open binary instead of looking argv[0] up (-1: off).
+        // argv[0] is still passed to the program. Must not be a script if CLOEXEC.
+        int exec_fd;
+
+        // Spawn through this fork server instead of spawn_backend (not owned; Linux)
+        spawn_server* server;
+
+        // Close every descriptor except 0-2 and inherit_fds in the child, whether
+        // or not it is CLOEXEC (close_range(2); constant cost even with a huge fd table)
+        bool close_other_fds;
+        // Descriptors passed to the child under the same number, CLOEXEC or not
+        // (must not be 0-2)
+        std::vector<int> inherit_fds;
+
+        // Child descriptors beyond 0-2, keyed by child fd number (>= 3), e.g.
+        // extra_fds[3] = extra_fd::output() for a bulk data channel on fd 3
+        std::map<int, extra_fd> extra_fds;
+
+        // Duplicate the child's stdout/stderr (which must be PIPE) into these
+        // descriptors inside the kernel with tee(2)/splice(2) (not owned). Data moves
+        // as the parent drives the stream: read_stdout() forwards what it returns to
+        // the sinks first; pump_stdout() forwards without giving the parent a copy.
+        // A sink that fails is dropped (see last_error()); the others carry on.
+        std::vector<int> out_tee_fds;
+        std::vector<int> err_tee_fds;
+
+        // Limits on what read_stdout()/read_stderr() take from the child (PIPE only)
+        output_limit out_limit;
+        output_limit err_limit;
+
         options()
         : parent_nonblock(false), clear_env(false),
-          setpgid(false), pgid(0) {}
+          setpgid(false), pgid(0),
+          spawn_backend(SPAWN_FORK),
+          resolver(0), exec_fd(-1), server(0),
+          close_other_fds(false) {}
     };
 
 public:
     popen3()
-    : pid_(-1),
+    : pid_(-1), pidfd_(-1), exerr_r_(-1),
       in_w_(-1), out_r_(-1), err_r_(-1),
       own_in_w_(false), own_out_r_(false), own_err_r_(false),
+      pgid_(0),
+      in_stream_(0), out_stream_(0), err_stream_(0),
       last_errno_(0) {}
 
     ~popen3() {
@@ -813,201 +1169,511 @@ public:
         close_stdin();
         close_stdout();
         close_stderr();
+        close_extra_fds_();
+        delete in_stream_;
+        delete out_stream_;
+        delete err_stream_;
         // Avoid zombies: call waitpid(WNOHANG) asynchronously
         if (pid_ > 0) {
             int status;
             ::waitpid(pid_, &status, WNOHANG);
         }
+        close_pidfd_();
+        if (exerr_r_ != -1) ::close(exerr_r_);
     }
 
     // Launch: argv must look like ["prog", "arg1", ...] and not be empty
     // Returns true on success / false on failure (see last_error() / last_errno() for details)
     bool start(const std::vector<std::string>& argv, const options& opt = options()) {
-        clear_last_error_();
-
-        if (argv.empty()) {
-            set_last_error_("argv is empty", EINVAL);
-            return false;
-        }
+        std::vector<char*> cargv;
+        cargv.reserve(argv.size() + 1);
+        for (size_t i = 0; i < argv.size(); ++i)
+            cargv.push_back(const_cast<char*>(argv[i].c_str()));
+        cargv.push_back(0);
+        return start_argv_(&cargv[0], opt);
+    }
 
-        // ---- Preparation: create the required pipes ----
-        int in_pipe[2]  = { -1, -1 }; // parent writes -> child reads (stdin)
-        int out_pipe[2] = { -1, -1 }; // child writes  -> parent reads (stdout)
-        int err_pipe[2] = { -1, -1 }; // child writes  -> parent reads (stderr)
+    // NULL-terminated argv, as for execv(); nothing is copied
+    bool start(const char* const* argv, const options& opt = options()) {
+        return start_argv_(const_cast<char* const*>(argv), opt);
+    }
 
-        if (opt.in.mode  == stream_spec::PIPE && ::pipe(in_pipe)  != 0)  return fail_perror_("pipe(stdin)");
-        if (opt.out.mode == stream_spec::PIPE && ::pipe(out_pipe) != 0)  { safe_close_pair_(in_pipe);  return fail_perror_("pipe(stdout)"); }
-        if (opt.err.mode == stream_spec::PIPE && ::pipe(err_pipe) != 0)  { safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); return fail_perror_("pipe(stderr)"); }
+    // argc entries of argv (no terminator needed); only the pointer array is copied
+    bool start(const char* const* argv, size_t argc, const options& opt = options()) {
+        std::vector<char*> cargv;
+        cargv.reserve(argc + 1);
+        for (size_t i = 0; i < argc; ++i) cargv.push_back(const_cast<char*>(argv[i]));
+        cargv.push_back(0);
+        return start_argv_(&cargv[0], opt);
+    }
 
-        // Pipe used to report exec failures (child -> parent sends errno)
-        int exerr[2] = { -1, -1 };
-        if (::pipe(exerr) != 0) {
-            safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe);
-            return fail_perror_("pipe(exec_err)");
+#if __cplusplus >= 201703L
+    // string_view arguments are packed into one NUL-separated buffer
+    bool start(const std::string_view* argv, size_t argc, const options& opt = options()) {
+        size_t total = 0;
+        for (size_t i = 0; i < argc; ++i) total += argv[i].size() + 1;
+        std::vector<char> buf(total);
+        std::vector<char*> cargv;
+        cargv.reserve(argc + 1);
+        char* p = buf.data();
+        for (size_t i = 0; i < argc; ++i) {
+            if (!argv[i].empty()) std::memcpy(p, argv[i].data(), argv[i].size());
+            p[argv[i].size()] = '\0';
+            cargv.push_back(p);
+            p += argv[i].size() + 1;
         }
-        // Add CLOEXEC on both sides so they close automatically after a successful exec
-        set_cloexec_(exerr[0]);
-        set_cloexec_(exerr[1]);
-
-        // Also add CLOEXEC to the parent-resident ends to prevent FD leaks
-        if (opt.in.mode  == stream_spec::PIPE) set_cloexec_(in_pipe[1]);
-        if (opt.out.mode == stream_spec::PIPE) set_cloexec_(out_pipe[0]);
-        if (opt.err.mode == stream_spec::PIPE) set_cloexec_(err_pipe[0]);
+        cargv.push_back(0);
+        return start_argv_(cargv.data(), opt);
+    }
+#endif
 
-        // ---- fork ----
-        pid_t p = ::fork();
-        if (p < 0) {
-            safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe);
-            safe_close_pair_(exerr);
-            return fail_perror_("fork");
+    // Launch cmds[i] into procs[i] (caller-provided, cmds.size() entries) without
+    // serializing on each child's exec: all children are spawned back to back,
+    // optionally split across `threads` threads, then their exec-error pipes are
+    // collected together with poll. Failed entries keep their error in
+    // procs[i].last_error(). Returns the number of children started.
+    static size_t start_many(const std::vector<std::vector<std::string> >& cmds, const options& opt,
+                             popen3* procs, size_t threads = 1) {
+        size_t n = cmds.size();
+        if (n == 0) return 0;
+        std::vector<std::vector<char*> > cargv(n);
+        for (size_t i = 0; i < n; ++i) {
+            cargv[i].reserve(cmds[i].size() + 1);
+            for (size_t j = 0; j < cmds[i].size(); ++j)
+                cargv[i].push_back(const_cast<char*>(cmds[i][j].c_str()));
+            cargv[i].push_back(0);
         }
+        std::vector<char> launched(n, 0);
+
+        // Spawn phase: each thread launches a contiguous slice
+        if (threads > n) threads = n;
+        if (threads < 1) threads = 1;
+        std::vector<launch_batch_> batches(threads);
+        size_t per = (n + threads - 1) / threads;
+        for (size_t t = 0; t < threads; ++t) {
+            launch_batch_& b = batches[t];
+            b.argv = &cargv[0];
+            b.opt = &opt;
+            b.procs = procs;
+            b.launched = &launched[0];
+            b.begin = std::min(n, t * per);
+            b.end = std::min(n, b.begin + per);
+        }
+        std::vector<pthread_t> tids(threads);
+        std::vector<char> joined(threads, 0);
+        for (size_t t = 1; t < threads; ++t)
+            joined[t] = (::pthread_create(&tids[t], 0, &launch_batch_::run, &batches[t]) == 0);
+        for (size_t t = 1; t < threads; ++t)
+            if (!joined[t]) launch_batch_::run(&batches[t]); // Could not start a thread: do it inline
+        launch_batch_::run(&batches[0]);
+        for (size_t t = 1; t < threads; ++t)
+            if (joined[t]) ::pthread_join(tids[t], 0);
+
+        // Collect phase: a pipe becomes readable once its child has exec'd (EOF) or failed
+        size_t started = 0;
+        std::vector<struct pollfd> pfds;
+        std::vector<size_t> owner;
+        for (size_t i = 0; i < n; ++i) {
+            if (!launched[i]) continue;
+            if (procs[i].exerr_r_ == -1) { started += procs[i].finish_launch_(); continue; }
+            struct pollfd pfd;
+            pfd.fd = procs[i].exerr_r_;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            pfds.push_back(pfd);
+            owner.push_back(i);
+        }
+        while (!pfds.empty()) {
+            int r = ::poll(&pfds[0], (nfds_t)pfds.size(), -1);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                break; // Finish the rest with blocking reads below
+            }
+            for (size_t k = pfds.size(); k-- > 0;) {
+                if (!pfds[k].revents) continue;
+                started += procs[owner[k]].finish_launch_();
+                pfds.erase(pfds.begin() + (std::ptrdiff_t)k);
+                owner.erase(owner.begin() + (std::ptrdiff_t)k);
+            }
+        }
+        for (size_t k = 0; k < owner.size(); ++k) started += procs[owner[k]].finish_launch_();
+        return started;
+    }
 
-        if (p == 0) {
-            // -------- child --------
-            // The child does not use exerr[0]
-            ::close(exerr[0]);
-
-            // Apply CLOEXEC to the child pipe ends so they close automatically on successful exec
-            if (opt.in.mode  == stream_spec::PIPE) set_cloexec_(in_pipe[0]);
-            if (opt.out.mode == stream_spec::PIPE) set_cloexec_(out_pipe[1]);
-            if (opt.err.mode == stream_spec::PIPE) set_cloexec_(err_pipe[1]);
+    // Write to the child's stdin. EINTR is retried internally; other errors propagate.
+    ssize_t write_stdin(const void* data, size_t len) {
+        if (in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return -1; }
+        return retry_eintr_write_(in_w_, data, len);
+    }
 
-            // Remap the standard streams
-            if (!setup_child_stdio_(opt, in_pipe, out_pipe, err_pipe, exerr[1])) _exit(127);
+    // Write len bytes to the child's stdin by mapping the pages into the pipe
+    // (vmsplice, Linux) instead of copying them. Ownership: the buffer must stay
+    // valid and unmodified until the child has read it, i.e. until
+    // stdin_pending_bytes() drops to 0 (or the child has exited). If the child
+    // splices its stdin onward, the pages travel with the data and stay
+    // referenced there. Blocks until everything is queued; with parent_nonblock
+    // it returns what fit, or -1/EAGAIN if nothing did. An error after part of
+    // the buffer was queued (e.g. EPIPE) returns that part's length, and the
+    // next call reports the error. Other platforms copy.
+    ssize_t write_stdin_zerocopy(const void* data, size_t len) {
+        if (in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return -1; }
+#if defined(__linux__)
+        int fl = ::fcntl(in_w_, F_GETFL);
+        unsigned flags = (fl != -1 && (fl & O_NONBLOCK)) ? SPLICE_F_NONBLOCK : 0u;
+        const char* p = static_cast<const char*>(data);
+        size_t done = 0;
+        while (done < len) {
+            struct iovec iov;
+            iov.iov_base = const_cast<char*>(p + done);
+            iov.iov_len = len - done;
+            ssize_t n = ::vmsplice(in_w_, &iov, 1, flags);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // The pipe already references the first done bytes: report them
+                if (done > 0) break;
+                set_last_error_("vmsplice", errno);
+                return -1;
+            }
+            done += (size_t)n;
+        }
+        return (ssize_t)done;
+#else
+        return write_stdin(data, len);
+#endif
+    }
 
-            // Adjust environment variables
-            if (!apply_child_env_(opt, exerr[1])) _exit(127);
+    // Bytes written to stdin that the child has not read yet (-1 on error).
+    // Completion signal for write_stdin_zerocopy: 0 means its buffers are free.
+    // Only meaningful before close_stdin(); afterwards the child's exit is the signal.
+    ssize_t stdin_pending_bytes() const {
+        if (in_w_ == -1) return 0;
+        int n = 0;
+        if (::ioctl(in_w_, FIONREAD, &n) != 0) return -1;
+        return n;
+    }
 
-            // chdir
-            if (!opt.chdir_to.empty()) {
-                if (::chdir(opt.chdir_to.c_str()) != 0) {
-                    write_errno_and_exit_(exerr[1], "chdir");
-                }
+    // Move up to len bytes of fd into the child's stdin without copying them through
+    // userspace (splice, then sendfile, then read/write for sources that support
+    // neither). offset >= 0 reads from there and leaves fd's file position alone;
+    // -1 reads from (and advances) the current position. Stops early at end of
+    // file. With parent_nonblock it returns what fit into the pipe, or -1/EAGAIN
+    // if nothing did. Returns the number of bytes transferred.
+    ssize_t feed_stdin_from_fd(int fd, off_t offset, size_t len) {
+        if (in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return -1; }
+        int fl = ::fcntl(in_w_, F_GETFL);
+        bool nonblock = (fl != -1) && (fl & O_NONBLOCK);
+        off_t off = offset;
+        off_t* offp = (offset >= 0) ? &off : 0;
+        size_t done = 0;
+        int method = 0; // 0: splice, 1: sendfile, 2: copy
+        while (done < len) {
+            size_t chunk = len - done;
+            if (chunk > (size_t)1 << 30) chunk = (size_t)1 << 30;
+            ssize_t n = -1;
+#if defined(__linux__)
+            if (method == 0) {
+                n = ::splice(fd, offp, in_w_, 0, chunk, SPLICE_F_MOVE | (nonblock ? SPLICE_F_NONBLOCK : 0));
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { method = 1; continue; }
+            } else if (method == 1) {
+                n = ::sendfile(in_w_, fd, offp, chunk);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { method = 2; continue; }
+            } else
+#endif
+            {
+                n = copy_to_stdin_(fd, offp, chunk, nonblock);
             }
-
-            // setpgid
-            if (opt.setpgid) {
-                pid_t target_pgid = opt.pgid ? opt.pgid : 0; // 0 means use our own PID
-                if (::setpgid(0, target_pgid) != 0) {
-                    write_errno_and_exit_(exerr[1], "setpgid");
-                }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (done > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                set_last_error_("feed_stdin_from_fd", errno);
+                return -1;
             }
+            if (n == 0) break; // End of file
+            done += (size_t)n;
+        }
+        return (ssize_t)done;
+    }
 
-            // Prepare argv
-            std::vector<char*> cargv;
-            cargv.reserve(argv.size() + 1);
-            for (size_t i = 0; i < argv.size(); ++i)
-                cargv.push_back(const_cast<char*>(argv[i].c_str()));
-            cargv.push_back(0);
-
-            // Use execvp (performs PATH lookup)
-            ::execvp(cargv[0], &cargv[0]);
+    // Read from the child's stdout / stderr
+    ssize_t read_stdout(void* buf, size_t len) {
+        if (out_r_ == -1) { set_last_error_("stdout is not a pipe", EBADF); return -1; }
+        if (out_limit_.active()) return limited_read_(out_limit_, out_tee_, out_r_, buf, len);
+        if (out_tee_.active()) return tee_read_(out_tee_, out_r_, buf, len);
+        return tuned_read_(out_r_, buf, len);
+    }
+    ssize_t read_stderr(void* buf, size_t len) {
+        if (err_r_ == -1) { set_last_error_("stderr is not a pipe", EBADF); return -1; }
+        if (err_limit_.active()) return limited_read_(err_limit_, err_tee_, err_r_, buf, len);
+        if (err_tee_.active()) return tee_read_(err_tee_, err_r_, buf, len);
+        return tuned_read_(err_r_, buf, len);
+    }
 
-            // Reaching this point means execvp failed
-            write_errno_and_exit_(exerr[1], "execvp");
-            // Unreachable because _exit terminates
-        }
+    // Counters of options.out_limit / err_limit for the current child
+    const output_limit_stats& stdout_limit_stats() const { return out_limit_.stats; }
+    const output_limit_stats& stderr_limit_stats() const { return err_limit_.stats; }
 
-        // -------- parent --------
-        pid_ = p;
+    // After a non-blocking read_stdout()/read_stderr() failed with EAGAIN because
+    // of a BACKPRESSURE max_rate: milliseconds until the budget allows the next
+    // read, 0 if it already does (or the stream is not throttled). The pipe stays
+    // readable meanwhile, so wait this long rather than polling it.
+    int stdout_limit_wait_ms() const { return out_limit_.wait_ms(); }
+    int stderr_limit_wait_ms() const { return err_limit_.wait_ms(); }
 
-        // For exerr, close the write end before reading errno
-        ::close(exerr[1]);
+    // Forward up to len bytes of stdout/stderr to the tee sinks only. Blocks like
+    // read_stdout(); returns the bytes forwarded, 0 at EOF, -1 on error.
+    ssize_t pump_stdout(size_t len = 1024 * 1024) {
+        if (out_r_ == -1) { set_last_error_("stdout is not a pipe", EBADF); return -1; }
+        return pump_(out_tee_, out_r_, len);
+    }
+    ssize_t pump_stderr(size_t len = 1024 * 1024) {
+        if (err_r_ == -1) { set_last_error_("stderr is not a pipe", EBADF); return -1; }
+        return pump_(err_tee_, err_r_, len);
+    }
 
-        // Close pipe ends that are no longer needed by either side
-        if (opt.in.mode  == stream_spec::PIPE)  ::close(in_pipe[0]);   // child-read end
-        if (opt.out.mode == stream_spec::PIPE)  ::close(out_pipe[1]);  // child-write end
-        if (opt.err.mode == stream_spec::PIPE)  ::close(err_pipe[1]);  // child-write end
+    // Scatter/gather versions of write_stdin / read_stdout / read_stderr.
+    // writev_stdin writes every byte of iov[0..iovcnt) (one writev per IOV_MAX
+    // entries unless the pipe takes less), resuming inside a partially written
+    // entry without touching the caller's array. With parent_nonblock it returns
+    // the bytes written so far on EAGAIN (-1 if none).
+    ssize_t writev_stdin(const struct iovec* iov, int iovcnt) {
+        if (in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return -1; }
+        return retry_eintr_writev_(in_w_, iov, iovcnt);
+    }
+    // With an output_limit these fill only the first non-empty entry.
+    ssize_t readv_stdout(const struct iovec* iov, int iovcnt) {
+        if (out_r_ == -1) { set_last_error_("stdout is not a pipe", EBADF); return -1; }
+        if (out_limit_.active()) return limited_readv_(out_limit_, out_tee_, out_r_, iov, iovcnt);
+        return tuned_readv_(out_tee_, out_r_, iov, iovcnt);
+    }
+    ssize_t readv_stderr(const struct iovec* iov, int iovcnt) {
+        if (err_r_ == -1) { set_last_error_("stderr is not a pipe", EBADF); return -1; }
+        if (err_limit_.active()) return limited_readv_(err_limit_, err_tee_, err_r_, iov, iovcnt);
+        return tuned_readv_(err_tee_, err_r_, iov, iovcnt);
+    }
 
-        // Save the parent-owned FDs
-        in_w_  = (opt.in.mode  == stream_spec::PIPE) ? in_pipe[1]  : -1;
-        out_r_ = (opt.out.mode == stream_spec::PIPE) ? out_pipe[0] : -1;
-        err_r_ = (opt.err.mode == stream_spec::PIPE) ? err_pipe[0] : -1;
-        own_in_w_  = (in_w_  != -1);
-        own_out_r_ = (out_r_ != -1);
-        own_err_r_ = (err_r_ != -1);
+    // Outcome of communicate()
+    struct communicate_result {
+        int status;        // waitpid-style, valid when exited
+        bool exited;       // false on timeout or error
+        bool timed_out;    // The deadline passed; the child was killed and reaped
+        size_t bytes_in;   // Bytes of input the child accepted
+        size_t bytes_out;  // Bytes appended to *out (or discarded)
+        size_t bytes_err;  // Same for *err
+        bool out_capped;   // A BACKPRESSURE max_bytes closed stdout early (options.out_limit)
+        bool err_capped;   // Same for stderr
+        communicate_result() : status(0), exited(false), timed_out(false), bytes_in(0), bytes_out(0), bytes_err(0),
+                               out_capped(false), err_capped(false) {}
+    };
 
-        if (opt.parent_nonblock) {
-            if (in_w_  != -1) set_nonblock_(in_w_,  true);
-            if (out_r_ != -1) set_nonblock_(out_r_, true);
-            if (err_r_ != -1) set_nonblock_(err_r_, true);
+    // Run the child to completion: write input to stdin and close it, while
+    // draining stdout/stderr concurrently (one poll loop, so a child that fills
+    // stderr before reading all its input cannot deadlock us), then wait for it.
+    // Output is appended to *out / *err (NULL discards it); their capacity is
+    // reused, so passing the same strings across runs avoids reallocation.
+    // If the child stops reading, the rest of the input is dropped (EPIPE).
+    // Like a shell, it waits for EOF, so a background grandchild that keeps a
+    // pipe open holds it until the deadline.
+    // Output limits apply. A BACKPRESSURE max_rate only delays reading, but once
+    // a BACKPRESSURE max_bytes is reached the stream is closed, since nothing
+    // would drain it before the exit: the child sees EPIPE (or SIGPIPE) on its
+    // next write, and out_capped / err_capped is set.
+    // timeout_ms < 0 means no deadline; on expiry the child is killed with
+    // SIGKILL. Returns true if the child exited (see result->status).
+    bool communicate(const void* input, size_t input_len, std::string* out, std::string* err,
+                     int timeout_ms = -1, communicate_result* result = 0) {
+        communicate_result dummy;
+        communicate_result& r = result ? *result : dummy;
+        r = communicate_result();
+        if (pid_ <= 0) { set_last_error_("no child", ECHILD); return false; }
+        if (input_len > 0 && in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return false; }
+
+        struct timespec t0;
+        ::clock_gettime(CLOCK_MONOTONIC, &t0);
+        sigpipe_guard_ guard;
+
+        if (input_len == 0) close_stdin();
+        if (in_w_  != -1) set_nonblock_(in_w_,  true);
+        if (out_r_ != -1) set_nonblock_(out_r_, true);
+        if (err_r_ != -1) set_nonblock_(err_r_, true);
+        const char* in = static_cast<const char*>(input);
+
+        bool ok = true;
+        for (;;) {
+            struct pollfd pfd[3];
+            int n = 0, i_in = -1, i_out = -1, i_err = -1;
+            // A rate-throttled stream stays readable; leave it out until its budget is back
+            int out_wait = (out_r_ != -1) ? stdout_limit_wait_ms() : 0;
+            int err_wait = (err_r_ != -1) ? stderr_limit_wait_ms() : 0;
+            if (in_w_  != -1) { i_in  = n; pfd[n].fd = in_w_;  pfd[n].events = POLLOUT; pfd[n++].revents = 0; }
+            if (out_r_ != -1 && !out_wait) { i_out = n; pfd[n].fd = out_r_; pfd[n].events = POLLIN; pfd[n++].revents = 0; }
+            if (err_r_ != -1 && !err_wait) { i_err = n; pfd[n].fd = err_r_; pfd[n].events = POLLIN; pfd[n++].revents = 0; }
+            if (n == 0 && !out_wait && !err_wait) break; // Every stream is done; only the exit is left
+
+            int wait_ms = remaining_ms_(t0, timeout_ms);
+            if (wait_ms == 0) { ok = false; break; }
+            if (out_wait && (wait_ms < 0 || out_wait < wait_ms)) wait_ms = out_wait;
+            if (err_wait && (wait_ms < 0 || err_wait < wait_ms)) wait_ms = err_wait;
+            int pr = ::poll(pfd, (nfds_t)n, wait_ms);
+            if (pr < 0) {
+                if (errno == EINTR) continue;
+                set_last_error_("poll", errno);
+                ok = false;
+                break;
+            }
+            if (pr == 0) continue; // Deadline is re-checked above
+
+            if (i_in != -1 && pfd[i_in].revents) {
+                ssize_t w;
+                do { w = ::write(in_w_, in + r.bytes_in, input_len - r.bytes_in); } while (w < 0 && errno == EINTR);
+                if (w > 0) r.bytes_in += (size_t)w;
+                if (r.bytes_in == input_len || (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                    close_stdin(); // Done, or the child stopped reading (EPIPE)
+            }
+            if (i_out != -1 && pfd[i_out].revents) {
+                if (!drain_into_(out_r_, out, r.bytes_out)) {
+                    if (errno == ENOBUFS) r.out_capped = true;
+                    close_stdout();
+                }
+            }
+            if (i_err != -1 && pfd[i_err].revents) {
+                if (!drain_into_(err_r_, err, r.bytes_err)) {
+                    if (errno == ENOBUFS) r.err_capped = true;
+                    close_stderr();
+                }
+            }
         }
 
-        // Check whether exec succeeded: the child writes errno(int) to exerr on failure
-        int child_exec_errno = 0;
-        ssize_t n = read_full_errno_(exerr[0], &child_exec_errno, sizeof(child_exec_errno));
-        ::close(exerr[0]);
-
-        if (n > 0) {
-            // Exec setup failed
+        // Reap, within what is left of the deadline
+        pid_t reaped = 0;
+        while (ok) {
+            int wait_ms = remaining_ms_(t0, timeout_ms);
+            if (wait_ms == 0) { ok = false; break; }
+            if (wait_ms < 0) { reaped = wait(&r.status, 0); break; }
+            reaped = wait(&r.status, WNOHANG);
+            if (reaped != 0) break;
+            if (pidfd_ != -1) {
+                struct pollfd pp = { pidfd_, POLLIN, 0 };
+                ::poll(&pp, 1, wait_ms);
+            } else {
+                ::usleep((useconds_t)std::min(wait_ms, 10) * 1000);
+            }
+        }
+        if (ok) {
+            if (reaped > 0) r.exited = true;
+            return r.exited;
+        }
+        if (remaining_ms_(t0, timeout_ms) == 0) {
+            r.timed_out = true;
+            kill(SIGKILL);
             int st;
-            ::waitpid(pid_, &st, 0); // Ensure the child is reaped
-            cleanup_parent_fds_();
-            char buf[128]; std::snprintf(buf, sizeof(buf), "exec failed (errno=%d)", child_exec_errno);
-            set_last_error_(buf, child_exec_errno);
-            pid_ = -1;
-            return false;
+            wait(&st, 0);
+            set_last_error_("communicate: timed out", ETIMEDOUT);
         }
-        // n == 0 means EOF (successful exec closed the pipe via CLOEXEC)
-        return true;
+        return false;
     }
 
-    // Write to the child's stdin. EINTR is retried internally; other errors propagate.
-    ssize_t write_stdin(const void* data, size_t len) {
-        if (in_w_ == -1) { set_last_error_("stdin is not a pipe", EBADF); return -1; }
-        return retry_eintr_write_(in_w_, data, len);
+    // Same for a pipe from options.extra_fds, addressed by its child fd number
+    ssize_t read_fd(int child_fd, void* buf, size_t len) {
+        int fd = parent_fd(child_fd);
+        if (fd == -1) { set_last_error_("no pipe for this child fd", EBADF); return -1; }
+        return tuned_read_(fd, buf, len);
     }
-
-    // Read from the child's stdout / stderr
-    ssize_t read_stdout(void* buf, size_t len) {
-        if (out_r_ == -1) { set_last_error_("stdout is not a pipe", EBADF); return -1; }
-        return retry_eintr_read_(out_r_, buf, len);
+    ssize_t write_fd(int child_fd, const void* data, size_t len) {
+        int fd = parent_fd(child_fd);
+        if (fd == -1) { set_last_error_("no pipe for this child fd", EBADF); return -1; }
+        return retry_eintr_write_(fd, data, len);
     }
-    ssize_t read_stderr(void* buf, size_t len) {
-        if (err_r_ == -1) { set_last_error_("stderr is not a pipe", EBADF); return -1; }
-        return retry_eintr_read_(err_r_, buf, len);
+
+    // Shrink adaptive pipes that have been nearly empty for idle_ms. Reads only
+    // shrink a pipe the child keeps writing to, so a child that went quiet after
+    // a burst keeps its large buffer until this is called, e.g. from a timer.
+    void trim_pipes(int idle_ms = 1000) {
+        for (std::map<int, pipe_tuner_>::iterator it = tuners_.begin(); it != tuners_.end(); ++it) {
+            pipe_tuner_& t = it->second;
+            if (t.cap <= t.min_cap || remaining_ms_(t.busy, idle_ms) != 0) continue;
+            int pending = 0;
+            if (::ioctl(it->first, FIONREAD, &pending) != 0 || (size_t)pending >= (size_t)t.cap / 16) continue;
+            // EBUSY if the child wrote meanwhile: try again on the next call
+            int r = set_pipe_size_(it->first, std::max((size_t)t.min_cap, (size_t)pending * 2));
+            if (r > 0) t.cap = r;
+            t.full = t.idle = 0;
+        }
     }
 
-    // Explicitly close the parent's pipe ends (useful if you want to trigger EPIPE)
-    void close_stdin()  { safe_close_(in_w_,  own_in_w_);  own_in_w_  = false; in_w_  = -1; }
-    void close_stdout() { safe_close_(out_r_, own_out_r_); own_out_r_ = false; out_r_ = -1; }
-    void close_stderr() { safe_close_(err_r_, own_err_r_); own_err_r_ = false; err_r_ = -1; }
+    // iostream adapters over the pipes, for blocking use (std::getline,
+    // operator<<, read/write). buffer_size takes effect when the stream is
+    // first created (0: 64 KiB). Defined after the platform sections.
+    std::ostream& stdin_stream(size_t buffer_size = 0);
+    std::istream& stdout_stream(size_t buffer_size = 0);
+    std::istream& stderr_stream(size_t buffer_size = 0);
+
+    // Explicitly close the parent's pipe ends (useful if you want to trigger EPIPE).
+    // stdin_stream() is flushed first.
+    void close_stdin()  { if (in_stream_) in_stream_->flush(); safe_close_(in_w_,  own_in_w_);  own_in_w_  = false; in_w_  = -1; }
+    void close_stdout() { tuners_.erase(out_r_); out_tee_.reset(); safe_close_(out_r_, own_out_r_); own_out_r_ = false; out_r_ = -1; }
+    void close_stderr() { tuners_.erase(err_r_); err_tee_.reset(); safe_close_(err_r_, own_err_r_); own_err_r_ = false; err_r_ = -1; }
+    void close_fd(int child_fd) {
+        std::map<int, int>::iterator it = extra_.find(child_fd);
+        if (it == extra_.end()) return;
+        tuners_.erase(it->second);
+        ::close(it->second);
+        extra_.erase(it);
+    }
 
     // Child process control
     pid_t pid() const { return pid_; }
 
     // Check if the child is alive (non-blocking)
+    // Uses WNOWAIT, so an exited child stays waitable and wait() still gets its status.
     bool alive() const {
         if (pid_ <= 0) return false;
-        int st;
-        pid_t r = ::waitpid(pid_, &st, WNOHANG);
-        return (r == 0);
+        siginfo_t info;
+        std::memset(&info, 0, sizeof(info));
+        if (waitid_(info, WEXITED | WNOHANG | WNOWAIT) != 0) return false;
+        return info.si_pid == 0;
     }
 
-    // wait: options can be 0, WNOHANG, etc.
+    // wait: options can be 0, WNOHANG, etc. (waitpid-style; returns the PID, 0 or -1)
+    // *status is encoded like waitpid's, so WIFEXITED/WEXITSTATUS etc. apply.
     int wait(int* status, int options) {
         if (pid_ <= 0) { set_last_error_("no child", ECHILD); return -1; }
-        int st;
+        int flags = WEXITED;
+        if (options & WNOHANG)    flags |= WNOHANG;
+        if (options & WUNTRACED)  flags |= WSTOPPED;
+        if (options & WCONTINUED) flags |= WCONTINUED;
+        siginfo_t info;
         int r;
         do {
-            r = ::waitpid(pid_, &st, options);
+            std::memset(&info, 0, sizeof(info));
+            r = waitid_(info, flags);
         } while (r == -1 && errno == EINTR);
-        if (r > 0) {
-            if (status) *status = st;
+        if (r != 0) {
+            set_last_error_("waitid", errno);
+            return -1;
+        }
+        if (info.si_pid == 0) return 0; // Not finished yet
+        pid_t reaped = info.si_pid;
+        if (status) *status = status_from_siginfo_(info);
+        if (info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED) {
             pid_ = -1;
+            close_pidfd_();
             cleanup_parent_fds_();
-        } else if (r == 0) {
-            // Not finished yet
-        } else {
-            set_last_error_("waitpid", errno);
         }
-        return r;
+        return reaped;
     }
 
-    // kill (send a signal)
+    // kill (send a signal); goes through the pidfd when there is one, so it
+    // can never hit a recycled PID
     int kill(int sig) {
         if (pid_ <= 0) { set_last_error_("no child", ECHILD); return -1; }
-        int r = ::kill(pid_, sig);
+        int r = -1;
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+        if (pidfd_ != -1) {
+            r = (int)::syscall(SYS_pidfd_send_signal, pidfd_, sig, (void*)0, 0);
+            if (r != 0 && errno != ENOSYS) { set_last_error_("pidfd_send_signal", errno); return r; }
+        }
+#endif
+        if (r != 0) r = ::kill(pid_, sig);
         if (r != 0) set_last_error_("kill", errno);
         return r;
     }
@@ -1016,176 +1682,4165 @@ public:
     int stdin_fd()  const { return in_w_;  } // Written by the parent
     int stdout_fd() const { return out_r_; } // Read by the parent
     int stderr_fd() const { return err_r_; } // Read by the parent
+    // pidfd of the child (Linux 5.3+, otherwise -1). Becomes readable when the child
+    // exits, so it can sit in the same poll/epoll set as the pipes.
+    int process_fd() const { return pidfd_; }
+    // Parent end of the extra_fds pipe installed as child_fd (-1 if none)
+    int parent_fd(int child_fd) const {
+        std::map<int, int>::const_iterator it = extra_.find(child_fd);
+        return (it == extra_.end()) ? -1 : it->second;
+    }
 
     // Most recent error
     const std::string& last_error() const { return last_error_msg_; }
     int last_errno() const { return last_errno_; }
 
 private:
+    friend class spawn_server;
+    friend class pipeline;
+    friend class worker_pool;
+    friend class reactor;
+    friend class framed_channel;
+    friend class output_capture;
+
     pid_t pid_;
+    int pidfd_;
+    int exerr_r_; // Pending exec-error pipe between launch_() and finish_launch_()
     int in_w_, out_r_, err_r_;
     bool own_in_w_, own_out_r_, own_err_r_;
+    std::map<int, int> extra_; // Child fd -> parent end of an extra_fds pipe
+
+    // Adaptive sizing state of a pipe the parent reads (keyed by the parent end)
+    struct pipe_tuner_ {
+        int cap;        // Current capacity
+        int min_cap;
+        unsigned full;  // Consecutive reads that found the pipe full
+        unsigned idle;  // Consecutive reads that found it nearly empty
+        struct timespec busy; // Last time a read found it more than nearly empty
+    };
+    std::map<int, pipe_tuner_> tuners_;
+
+    // Kernel-side copies of an output stream (options.out_tee_fds / err_tee_fds)
+    struct tee_state_ {
+        std::vector<int> sinks; // -1 once dropped
+        int stage[2];           // Parent-only pipe that tee(2) fills for each non-pipe-capable hop
+        bool nonblock;
+        tee_state_() : nonblock(false) { stage[0] = stage[1] = -1; }
+        ~tee_state_() { reset(); }
+        bool active() const {
+            for (size_t i = 0; i < sinks.size(); ++i) if (sinks[i] != -1) return true;
+            return false;
+        }
+        void reset() {
+            safe_close_pair_(stage);
+            sinks.clear();
+        }
+    };
+    tee_state_ out_tee_, err_tee_;
+
+    // Budget of an output_limit: bytes delivered so far, plus a token bucket for max_rate
+    struct limit_state_ {
+        output_limit limit;
+        output_limit_stats stats;
+        double tokens;         // Bytes the rate budget allows right now (at most max_rate)
+        double need;           // Budget a throttled non-blocking read waits for, else 0
+        struct timespec last;  // When tokens was last refilled
+        limit_state_() : tokens(0), need(0) { last.tv_sec = 0; last.tv_nsec = 0; }
+        bool active() const { return limit.max_bytes != 0 || limit.max_rate != 0; }
+        void reset(const output_limit& l) {
+            limit = l;
+            stats = output_limit_stats();
+            tokens = (double)l.max_rate;
+            need = 0;
+            ::clock_gettime(CLOCK_MONOTONIC, &last);
+        }
+        void refill() {
+            struct timespec now;
+            ::clock_gettime(CLOCK_MONOTONIC, &now);
+            double dt = (double)(now.tv_sec - last.tv_sec) + (double)(now.tv_nsec - last.tv_nsec) / 1e9;
+            last = now;
+            tokens = std::min((double)limit.max_rate, tokens + dt * (double)limit.max_rate);
+        }
+        // Milliseconds until the budget reaches need (rounded up), 0 if it has
+        int wait_ms() const {
+            if (need <= 0 || limit.max_rate == 0) return 0;
+            struct timespec now;
+            ::clock_gettime(CLOCK_MONOTONIC, &now);
+            double dt = (double)(now.tv_sec - last.tv_sec) + (double)(now.tv_nsec - last.tv_nsec) / 1e9;
+            double missing = need - (tokens + dt * (double)limit.max_rate);
+            if (missing <= 0) return 0;
+            return (int)(missing * 1000 / (double)limit.max_rate) + 1;
+        }
+    };
+    limit_state_ out_limit_, err_limit_;
+    pid_t pgid_; // Process group the child leads or joined (options.setpgid), else 0
+
+    std::ostream* in_stream_;
+    std::istream* out_stream_;
+    std::istream* err_stream_;
     std::string last_error_msg_;
     int last_errno_;
 
-    // ---- Child setup helpers ----
-    bool setup_child_stdio_(const options& opt, int in_pipe[2], int out_pipe[2], int err_pipe[2], int exerr_w) {
-        // stdin
-        if (opt.in.mode == stream_spec::PIPE) {
-            ::close(in_pipe[1]); // Close the parent's write end
-            if (::dup2(in_pipe[0], 0) == -1) { write_errno_and_exit_(exerr_w, "dup2(stdin)"); }
-            if (in_pipe[0] != 0) ::close(in_pipe[0]);
-        } else if (opt.in.mode == stream_spec::USE_FD) {
-            if (opt.in.fd != 0) {
-                if (::dup2(opt.in.fd, 0) == -1) { write_errno_and_exit_(exerr_w, "dup2(stdin FD)"); }
-            }
-            // Close the original FD in the child to avoid leaks (does not affect the parent)
-            if (opt.in.fd > 2) ::close(opt.in.fd);
-        }
-        // stdout
-        if (opt.out.mode == stream_spec::PIPE) {
-            ::close(out_pipe[0]);
-            if (::dup2(out_pipe[1], 1) == -1) { write_errno_and_exit_(exerr_w, "dup2(stdout)"); }
-            if (out_pipe[1] != 1) ::close(out_pipe[1]);
-        } else if (opt.out.mode == stream_spec::USE_FD) {
-            if (opt.out.fd != 1) {
-                if (::dup2(opt.out.fd, 1) == -1) { write_errno_and_exit_(exerr_w, "dup2(stdout FD)"); }
-            }
-            if (opt.out.fd > 2) ::close(opt.out.fd);
-        }
-        // stderr
-        if (opt.err.mode == stream_spec::PIPE) {
-            ::close(err_pipe[0]);
-            if (::dup2(err_pipe[1], 2) == -1) { write_errno_and_exit_(exerr_w, "dup2(stderr)"); }
-            if (err_pipe[1] != 2) ::close(err_pipe[1]);
-        } else if (opt.err.mode == stream_spec::USE_FD) {
-            if (opt.err.fd != 2) {
-                if (::dup2(opt.err.fd, 2) == -1) { write_errno_and_exit_(exerr_w, "dup2(stderr FD)"); }
-            }
-            if (opt.err.fd > 2) ::close(opt.err.fd);
-        }
-        return true;
+    // ---- Launch ----
+    // argv is NULL-terminated and stays valid for the duration of the call
+    bool start_argv_(char* const* argv, const options& opt) {
+        return launch_(argv, opt) && finish_launch_();
     }
 
-    bool apply_child_env_(const options& opt, int exerr_w) {
-        if (opt.clear_env) {
-#if defined(__GLIBC__)
-            // clearenv is available with glibc
-            if (::clearenv() != 0) {
-                write_errno_and_exit_(exerr_w, "clearenv");
-            }
-#else
-            // Do nothing on non-glibc systems (for compatibility)
-#endif
+    // Spawn the child without waiting for its exec; finish_launch_() collects the
+    // outcome from exerr_r_ (start_many overlaps that wait across children)
+    bool launch_(char* const* argv, const options& opt) {
+        clear_last_error_();
+        if (exerr_r_ != -1) { ::close(exerr_r_); exerr_r_ = -1; }
+
+        if (!argv || !argv[0]) {
+            set_last_error_("argv is empty", EINVAL);
+            return false;
         }
-        for (size_t i = 0; i < opt.env_kv.size(); ++i) {
-            const std::string& kv = opt.env_kv[i];
-            std::string k, v;
-            split_kv_(kv, k, v);
-            if (k.empty()) continue;
-            if (::setenv(k.c_str(), v.c_str(), 1) != 0) {
-                write_errno_and_exit_(exerr_w, "setenv");
+
+        // ---- Preparation: create the required pipes ----
+        int in_pipe[2]  = { -1, -1 }; // parent writes -> child reads (stdin)
+        int out_pipe[2] = { -1, -1 }; // child writes  -> parent reads (stdout)
+        int err_pipe[2] = { -1, -1 }; // child writes  -> parent reads (stderr)
+
+        // CLOEXEC on every pipe end: the parent ends must not leak into the child, and
+        // the child ends are installed with dup2, which clears the flag on the target
+        if (opt.in.mode  == stream_spec::PIPE && pipe_cloexec_(in_pipe)  != 0)  return fail_perror_("pipe(stdin)");
+        if (opt.out.mode == stream_spec::PIPE && pipe_cloexec_(out_pipe) != 0)  { safe_close_pair_(in_pipe);  return fail_perror_("pipe(stdout)"); }
+        if (opt.err.mode == stream_spec::PIPE && pipe_cloexec_(err_pipe) != 0)  { safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); return fail_perror_("pipe(stderr)"); }
+        if (memory_input_(opt.in) && (in_pipe[0] = open_memory_input_(opt.in)) == -1) {
+            int e = errno;
+            safe_close_pair_(out_pipe); safe_close_pair_(err_pipe);
+            errno = e;
+            return fail_perror_("memfd(stdin)");
+        }
+        if (opt.in.mode  == stream_spec::PIPE) size_pipe_(in_pipe[1], opt.in, false);
+        if (opt.out.mode == stream_spec::PIPE) size_pipe_(out_pipe[0], opt.out, true);
+        if (opt.err.mode == stream_spec::PIPE) size_pipe_(err_pipe[0], opt.err, true);
+
+        // Descriptors the child installs as dst[i] (src -1 leaves the inherited one alone):
+        // 0/1/2, then extra_fds in ascending order
+        size_t nfds = 3 + opt.extra_fds.size();
+        std::vector<int> src(nfds), dst(nfds), child_tmp(nfds);
+        src[0] = child_source_(opt.in,  in_pipe[0]);
+        src[1] = child_source_(opt.out, out_pipe[1]);
+        src[2] = child_source_(opt.err, err_pipe[1]);
+        for (int i = 0; i < 3; ++i) dst[i] = i;
+
+        if (memory_input_(opt.out) || memory_input_(opt.err)) {
+            safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe);
+            set_last_error_("memory streams are input-only", EINVAL);
+            return false;
+        }
+        if ((!opt.out_tee_fds.empty() && opt.out.mode != stream_spec::PIPE) ||
+            (!opt.err_tee_fds.empty() && opt.err.mode != stream_spec::PIPE)) {
+            safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe);
+            set_last_error_("tee fds require a PIPE stream", EINVAL);
+            return false;
+        }
+
+        std::vector<int> extra_pipes; // Pairs: [read end, write end], -1 when not a pipe
+        size_t k = 3;
+        for (std::map<int, extra_fd>::const_iterator it = opt.extra_fds.begin(); it != opt.extra_fds.end(); ++it, ++k) {
+            int pp[2] = { -1, -1 };
+            if (it->first < 3) {
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                set_last_error_("extra_fds: child fd must be >= 3", EINVAL);
+                return false;
+            }
+            if (it->second.spec.mode == stream_spec::PIPE && pipe_cloexec_(pp) != 0) {
+                int e = errno;
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                errno = e;
+                return fail_perror_("pipe(extra_fds)");
+            }
+            if (memory_input_(it->second.spec)) {
+                if (it->second.child_writes) {
+                    safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                    set_last_error_("extra_fds: memory streams are input-only", EINVAL);
+                    return false;
+                }
+                if ((pp[0] = open_memory_input_(it->second.spec)) == -1) {
+                    int e = errno;
+                    safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                    errno = e;
+                    return fail_perror_("memfd(extra_fds)");
+                }
             }
+            if (pp[1] != -1) size_pipe_(pp[0], it->second.spec, it->second.child_writes);
+            extra_pipes.push_back(pp[0]);
+            extra_pipes.push_back(pp[1]);
+            dst[k] = it->first;
+            src[k] = child_source_(it->second.spec, it->second.child_writes ? pp[1] : pp[0]);
         }
-        return true;
-    }
 
-    // ---- util ----
-    void cleanup_parent_fds_() {
-        close_stdin();
-        close_stdout();
-        close_stderr();
-    }
+        // argv/envp are finished here; the child only issues syscalls
+        exec_plan_ plan;
+        prepare_exec_plan_(argv, opt, plan);
 
-    void set_last_error_(const char* msg, int err) {
-        last_error_msg_ = msg ? msg : "";
+        // Skip the PATH walk in the child: pre-opened binary, or a cached lookup
+        if (opt.exec_fd >= 0) {
+            plan.exec_fd = opt.exec_fd;
+        } else if (opt.resolver && opt.resolver->resolve(argv[0], plan.path, plan.resolved, &plan.owned_fd)) {
+            plan.exec_path = plan.resolved.c_str();
+            plan.exec_fd = plan.owned_fd;
+        }
+
+        spawn_backend_t backend = opt.spawn_backend;
+        if (backend == SPAWN_POSIX_SPAWN && !posix_spawn_can_honor_(opt, plan, &src[0])) backend = SPAWN_VFORK;
+
+        // Pipe used to report exec failures (child -> parent sends errno).
+        // posix_spawn and the fork server report them through their results instead.
+        int exerr[2] = { -1, -1 };
+        if (!opt.server && backend != SPAWN_POSIX_SPAWN) {
+            // CLOEXEC on both sides so they close automatically after a successful exec
+            if (pipe_cloexec_(exerr) != 0) {
+                int e = errno;
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                errno = e;
+                return fail_perror_("pipe(exec_err)");
+            }
+        }
+
+        pid_t p = -1;
+        if (opt.server) {
+            int r = 0;
+            if (!spawn_via_server_(opt, plan, &src[0], &dst[0], nfds, &p, &r)) {
+                int e = errno;
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                char buf[256]; std::snprintf(buf, sizeof(buf), "spawn_server: %s", std::strerror(e));
+                set_last_error_(buf, e);
+                return false;
+            }
+            if (r != 0) {
+                int st;
+                if (p > 0) ::waitpid(p, &st, 0); // The child is ours (CLONE_PARENT): reap it
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                char buf[128]; std::snprintf(buf, sizeof(buf), "exec failed (errno=%d)", r);
+                set_last_error_(buf, r);
+                return false;
+            }
+        } else if (backend == SPAWN_POSIX_SPAWN) {
+            int r = spawn_posix_(opt, plan, &src[0], &p);
+            if (r != 0) {
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                char buf[128]; std::snprintf(buf, sizeof(buf), "exec failed (errno=%d)", r);
+                set_last_error_(buf, r);
+                return false;
+            }
+        } else {
+            child_ctx_ ctx;
+            init_child_ctx_(ctx, opt, plan, &src[0], &dst[0], &child_tmp[0], nfds, exerr[1]);
+            if (backend == SPAWN_VFORK) {
+                p = spawn_vfork_(ctx);
+            } else {
+                p = ::fork();
+                if (p == 0) child_exec_(ctx); // Does not return
+            }
+            if (p < 0) {
+                int e = errno;
+                safe_close_pair_(in_pipe); safe_close_pair_(out_pipe); safe_close_pair_(err_pipe); close_all_(extra_pipes);
+                safe_close_pair_(exerr);
+                errno = e;
+                return fail_perror_(backend == SPAWN_VFORK ? "vfork" : "fork");
+            }
+        }
+
+        // -------- parent --------
+        pid_ = p;
+
+        // For exerr, close the write end before reading errno
+        if (exerr[1] != -1) ::close(exerr[1]);
+
+        // Close pipe ends that are no longer needed by either side
+        if (in_pipe[0] != -1)                   ::close(in_pipe[0]);   // child-read end (pipe or memfd)
+        if (opt.out.mode == stream_spec::PIPE)  ::close(out_pipe[1]);  // child-write end
+        if (opt.err.mode == stream_spec::PIPE)  ::close(err_pipe[1]);  // child-write end
+
+        // Save the parent-owned FDs
+        in_w_  = (opt.in.mode  == stream_spec::PIPE) ? in_pipe[1]  : -1;
+        out_r_ = (opt.out.mode == stream_spec::PIPE) ? out_pipe[0] : -1;
+        err_r_ = (opt.err.mode == stream_spec::PIPE) ? err_pipe[0] : -1;
+        own_in_w_  = (in_w_  != -1);
+        own_out_r_ = (out_r_ != -1);
+        own_err_r_ = (err_r_ != -1);
+
+        close_extra_fds_();
+        k = 0;
+        for (std::map<int, extra_fd>::const_iterator it = opt.extra_fds.begin(); it != opt.extra_fds.end(); ++it, k += 2) {
+            if (extra_pipes[k] == -1) continue;
+            if (extra_pipes[k + 1] == -1) { ::close(extra_pipes[k]); continue; } // memfd: nothing for the parent
+            ::close(extra_pipes[k + (it->second.child_writes ? 1 : 0)]);
+            extra_[it->first] = extra_pipes[k + (it->second.child_writes ? 0 : 1)];
+        }
+
+        setup_tee_(out_tee_, opt.out_tee_fds, out_r_, opt.parent_nonblock);
+        setup_tee_(err_tee_, opt.err_tee_fds, err_r_, opt.parent_nonblock);
+        out_limit_.reset(opt.out_limit);
+        err_limit_.reset(opt.err_limit);
+        pgid_ = opt.setpgid ? (opt.pgid ? opt.pgid : p) : 0;
+
+        tuners_.clear();
+        if (out_r_ != -1 && opt.out.adaptive) track_pipe_(out_r_);
+        if (err_r_ != -1 && opt.err.adaptive) track_pipe_(err_r_);
+        for (std::map<int, extra_fd>::const_iterator it = opt.extra_fds.begin(); it != opt.extra_fds.end(); ++it)
+            if (it->second.spec.adaptive && it->second.child_writes && extra_.count(it->first)) track_pipe_(extra_[it->first]);
+
+        if (opt.parent_nonblock) {
+            if (in_w_  != -1) set_nonblock_(in_w_,  true);
+            if (out_r_ != -1) set_nonblock_(out_r_, true);
+            if (err_r_ != -1) set_nonblock_(err_r_, true);
+            for (std::map<int, int>::iterator it = extra_.begin(); it != extra_.end(); ++it) set_nonblock_(it->second, true);
+        }
+
+        exerr_r_ = exerr[0];
+        return true;
+    }
+
+    // One thread's share of start_many()
+    struct launch_batch_ {
+        std::vector<char*>* argv;
+        const options* opt;
+        popen3* procs;
+        char* launched;
+        size_t begin, end;
+        static void* run(void* arg) {
+            launch_batch_* b = static_cast<launch_batch_*>(arg);
+            for (size_t i = b->begin; i < b->end; ++i)
+                b->launched[i] = b->procs[i].launch_(&b->argv[i][0], *b->opt);
+            return 0;
+        }
+    };
+
+    bool finish_launch_() {
+        // Check whether exec succeeded: the child writes errno(int) to exerr on failure
+        int child_exec_errno = 0;
+        ssize_t n = 0;
+        if (exerr_r_ != -1) {
+            n = read_full_errno_(exerr_r_, &child_exec_errno, sizeof(child_exec_errno));
+            ::close(exerr_r_);
+            exerr_r_ = -1;
+        }
+
+        if (n > 0) {
+            // Exec setup failed
+            int st;
+            ::waitpid(pid_, &st, 0); // Ensure the child is reaped
+            cleanup_parent_fds_();
+            char buf[128]; std::snprintf(buf, sizeof(buf), "exec failed (errno=%d)", child_exec_errno);
+            set_last_error_(buf, child_exec_errno);
+            pid_ = -1;
+            return false;
+        }
+        // n == 0 means EOF (successful exec closed the pipe via CLOEXEC)
+        open_pidfd_();
+        return true;
+    }
+
+    // ---- Exec preparation (parent side) ----
+    // Everything the child touches is built here, so the child side only issues
+    // syscalls: no malloc between fork and exec, and safe with a shared address space.
+    struct exec_plan_ {
+        char* const* argv;                   // NULL-terminated, owned by the caller
+        std::vector<char*> envp;             // Empty means inherit environ as-is
+        std::vector<std::string> env_extra;  // "KEY=" entries synthesized from a bare "KEY"
+        const char* path;                    // PATH used for the command lookup (may be NULL)
+        bool path_overridden;                // PATH differs from the parent's own environ
+        const char* exec_path;               // Resolved executable (NULL: search PATH)
+        int exec_fd;                         // Binary to exec directly (-1: none)
+        std::string resolved;                // Storage for exec_path
+        int owned_fd;                        // Descriptor from the resolver, closed with the plan
+        mutable std::vector<char*> sh_argv;  // {"/bin/sh", <script>, argv[1..], NULL}; the child fills in <script>
+        exec_plan_() : argv(0), path(0), path_overridden(false), exec_path(0), exec_fd(-1), owned_fd(-1) {}
+        ~exec_plan_() { if (owned_fd != -1) ::close(owned_fd); }
+    };
+
+    struct child_ctx_ {
+        const int* src;    // Descriptor installed as dst[i] (-1: leave dst[i] untouched)
+        const int* dst;
+        int* tmp;          // Scratch of nfds entries for relocated sources
+        size_t nfds;
+        int min_free;      // Sources that would be overwritten are moved at or above this number
+        const char* chdir_to;
+        bool setpgid;
+        pid_t pgid;
+        char* const* argv;
+        char* const* envp;
+        const char* path;
+        const char* exec_path;        // Exec this path instead of searching PATH
+        int exec_fd;                  // Exec this descriptor (takes precedence over exec_path)
+        char** sh_argv;               // ENOEXEC fallback through /bin/sh, as execvp does (NULL: none)
+        int exerr_w;
+        const sigset_t* restore_mask; // Non-NULL: reset handlers to SIG_DFL, then restore this mask
+        bool close_others;            // Close everything but 0-2, dst[] and keep[]
+        const int* keep;              // Inherited as-is (CLOEXEC cleared)
+        size_t nkeep;
+    };
+
+    static bool memory_input_(const stream_spec& s) {
+        return s.mode == stream_spec::MEMORY || s.mode == stream_spec::MEMFD;
+    }
+
+    // Unlinked, CLOEXEC, read-write file in dir ($TMPDIR or /tmp when empty): O_TMPFILE
+    // where supported, else mkstemp + unlink. -1 with errno on failure.
+    static int open_tmpfile_(std::string dir, const char* prefix) {
+        int fd = -1;
+        if (dir.empty()) {
+            const char* t = std::getenv("TMPDIR");
+            dir = (t && *t) ? t : "/tmp";
+        }
+#if defined(__linux__) && defined(O_TMPFILE)
+        fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd != -1) return fd;
+#endif
+        std::string path = dir + "/" + prefix + "-XXXXXX";
+        std::vector<char> tmpl(path.begin(), path.end());
+        tmpl.push_back('\0');
+        fd = ::mkstemp(&tmpl[0]);
+        if (fd == -1) return -1;
+        ::unlink(&tmpl[0]);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+
+    // The child's end of a MEMORY/MEMFD stream: a CLOEXEC descriptor at offset 0,
+    // sealed against writes and resizing where the kernel supports seals (a caller's
+    // memfd created without MFD_ALLOW_SEALING, or a plain file, is used unsealed).
+    // -1 with errno on failure.
+    static int open_memory_input_(const stream_spec& s) {
+        int fd = -1;
+        if (s.mode == stream_spec::MEMFD) {
+            fd = ::fcntl(s.fd, F_DUPFD_CLOEXEC, 0);
+            if (fd == -1) return -1;
+        } else {
+#if defined(__linux__) && defined(SYS_memfd_create)
+            fd = (int)::syscall(SYS_memfd_create, "tinyproc-input", 3U /* MFD_CLOEXEC | MFD_ALLOW_SEALING */);
+#endif
+            if (fd == -1) fd = open_tmpfile_(std::string(), "tinyproc-input");
+            if (fd == -1) return -1;
+            if (!write_full_(fd, static_cast<const char*>(s.data), s.size)) {
+                int e = errno;
+                ::close(fd);
+                errno = e;
+                return -1;
+            }
+        }
+#if defined(F_ADD_SEALS) && defined(F_SEAL_WRITE)
+        // EPERM (not sealable) or EBUSY (writable mappings exist): hand it over as-is
+        ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+        if (::lseek(fd, 0, SEEK_SET) == (off_t)-1) {
+            int e = errno;
+            ::close(fd);
+            errno = e;
+            return -1;
+        }
+        return fd;
+    }
+
+    static int child_source_(const stream_spec& s, int pipe_end) {
+        if (s.mode == stream_spec::PIPE || memory_input_(s)) return pipe_end;
+        if (s.mode == stream_spec::USE_FD) return s.fd;
+        return -1;
+    }
+
+    static void prepare_exec_plan_(char* const* argv, const options& opt, exec_plan_& plan) {
+        plan.argv = argv;
+        build_sh_argv_(argv, plan.sh_argv);
+
+        plan.path = std::getenv("PATH");
+        if (!opt.clear_env && opt.env_kv.empty()) return; // Inherit environ unchanged
+
+        // A bare "KEY" means KEY=""; materialize those first so the pointers stay valid
+        for (size_t i = 0; i < opt.env_kv.size(); ++i)
+            if (!opt.env_kv[i].empty() && opt.env_kv[i].find('=') == std::string::npos)
+                plan.env_extra.push_back(opt.env_kv[i] + "=");
+
+        std::vector<const char*> assigned;
+        size_t extra = 0;
+        for (size_t i = 0; i < opt.env_kv.size(); ++i) {
+            const std::string& kv = opt.env_kv[i];
+            if (kv.empty() || kv[0] == '=') continue; // Empty key
+            const char* e = (kv.find('=') == std::string::npos) ? plan.env_extra[extra++].c_str() : kv.c_str();
+            // Later assignments win, as with repeated setenv()
+            for (size_t j = 0; j < assigned.size(); ++j) {
+                if (same_env_key_(assigned[j], e)) { assigned.erase(assigned.begin() + j); break; }
+            }
+            assigned.push_back(e);
+        }
+
+        if (!opt.clear_env && environ) {
+            for (char** ep = environ; *ep; ++ep) {
+                bool shadowed = false;
+                for (size_t j = 0; j < assigned.size() && !shadowed; ++j)
+                    shadowed = same_env_key_(*ep, assigned[j]);
+                if (!shadowed) plan.envp.push_back(*ep);
+            }
+        }
+        for (size_t j = 0; j < assigned.size(); ++j)
+            plan.envp.push_back(const_cast<char*>(assigned[j]));
+        plan.envp.push_back(0);
+
+        // Search the final environment's PATH, as execvp would after setenv()
+        const char* parent_path = plan.path;
+        plan.path = 0;
+        for (size_t j = 0; plan.envp[j]; ++j) {
+            if (std::strncmp(plan.envp[j], "PATH=", 5) == 0) { plan.path = plan.envp[j] + 5; break; }
+        }
+        plan.path_overridden = (plan.path != parent_path);
+    }
+
+    // Like execvp, a file the kernel refuses with ENOEXEC is run as a script: /bin/sh
+    // <file> argv[1..]. Built here because the child may not allocate.
+    static void build_sh_argv_(char* const* argv, std::vector<char*>& sh) {
+        static char sh_path[] = "/bin/sh";
+        sh.clear();
+        sh.push_back(sh_path);
+        sh.push_back(0); // The script path, set by the child
+        for (size_t i = 1; argv[0] && argv[i]; ++i) sh.push_back(argv[i]);
+        sh.push_back(0);
+    }
+
+    static bool same_env_key_(const char* a, const char* b) {
+        while (*a && *a != '=' && *a == *b) { ++a; ++b; }
+        return (*a == '=' || *a == '\0') && (*b == '=' || *b == '\0');
+    }
+
+    static void init_child_ctx_(child_ctx_& c, const options& opt, const exec_plan_& plan,
+                                const int* src, const int* dst, int* tmp, size_t nfds, int exerr_w) {
+        c.src = src; c.dst = dst; c.tmp = tmp; c.nfds = nfds;
+        c.min_free = 3;
+        for (size_t i = 0; i < nfds; ++i)
+            if (dst[i] >= c.min_free) c.min_free = dst[i] + 1;
+        c.chdir_to = opt.chdir_to.empty() ? 0 : opt.chdir_to.c_str();
+        c.setpgid = opt.setpgid;
+        c.pgid = opt.pgid;
+        c.argv = plan.argv;
+        c.envp = plan.envp.empty() ? environ : &plan.envp[0];
+        c.path = plan.path;
+        c.exec_path = plan.exec_path;
+        c.exec_fd = plan.exec_fd;
+        c.sh_argv = &plan.sh_argv[0];
+        c.exerr_w = exerr_w;
+        c.restore_mask = 0;
+        c.close_others = opt.close_other_fds;
+        c.keep = opt.inherit_fds.empty() ? 0 : &opt.inherit_fds[0];
+        c.nkeep = opt.inherit_fds.size();
+    }
+
+    // ---- Fork server (defined after spawn_server) ----
+    bool spawn_via_server_(const options& opt, const exec_plan_& plan, const int* src, const int* dst, size_t nfds,
+                           pid_t* pid, int* exec_err);
+
+    // ---- SPAWN_VFORK ----
+#if defined(__linux__)
+    static int clone_entry_(void* arg) {
+        child_exec_(*static_cast<const child_ctx_*>(arg));
+        return 127;
+    }
+#endif
+
+    static pid_t spawn_vfork_(child_ctx_& c) {
+        // Block every signal so none of our handlers runs in the child while it
+        // shares our memory; the child resets handlers before restoring the mask.
+        sigset_t all, old;
+        sigfillset(&all);
+        ::sigprocmask(SIG_SETMASK, &all, &old);
+        c.restore_mask = &old;
+
+        pid_t p;
+#if defined(__linux__)
+        // The child runs on its own small stack; we are suspended until it execs or exits
+        const size_t stack_size = 64 * 1024;
+        void* stack = ::mmap(0, stack_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+            p = -1;
+        } else {
+            p = ::clone(clone_entry_, static_cast<char*>(stack) + stack_size,
+                        CLONE_VM | CLONE_VFORK | SIGCHLD, &c);
+            int e = errno;
+            ::munmap(stack, stack_size);
+            errno = e;
+        }
+#else
+        p = ::vfork();
+        if (p == 0) child_exec_(c);
+#endif
+        int e = errno;
+        ::sigprocmask(SIG_SETMASK, &old, 0);
+        errno = e;
+        return p;
+    }
+
+    // ---- SPAWN_POSIX_SPAWN ----
+    static bool posix_spawn_can_honor_(const options& opt, const exec_plan_& plan, const int* src) {
+#if !defined(TINYPROC_HAS_SPAWN_CHDIR)
+        if (!opt.chdir_to.empty()) return false;
+#endif
+        if (plan.exec_fd >= 0) return false;
+        if (!opt.inherit_fds.empty()) return false;
+        // A pipe end could sit on another entry's target; the generic remap handles that
+        if (!opt.extra_fds.empty()) return false;
+#if !defined(TINYPROC_HAS_SPAWN_CLOSEFROM)
+        if (opt.close_other_fds) return false;
+#endif
+        // posix_spawnp searches the parent's PATH, not the one in envp
+        if (!plan.exec_path && plan.path_overridden && !std::strchr(plan.argv[0], '/')) return false;
+        for (int i = 0; i < 3; ++i) {
+            if (src[i] < 0) continue;
+            // A source among 0..2 would be overwritten by an earlier dup2 action
+            if (src[i] < 3 && src[i] != i) return false;
+#if !defined(TINYPROC_HAS_SPAWN_CHDIR)
+            if (src[i] == i) return false; // adddup2(fd, fd) may not clear FD_CLOEXEC
+#endif
+        }
+        return true;
+    }
+
+    // Returns 0 or an errno value (exec failures included)
+    static int spawn_posix_(const options& opt, const exec_plan_& plan, const int* src, pid_t* pid) {
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        int r = ::posix_spawn_file_actions_init(&fa);
+        if (r != 0) return r;
+        r = ::posix_spawnattr_init(&attr);
+        if (r != 0) { ::posix_spawn_file_actions_destroy(&fa); return r; }
+
+        for (int i = 0; i < 3 && r == 0; ++i)
+            if (src[i] >= 0) r = ::posix_spawn_file_actions_adddup2(&fa, src[i], i);
+        // Close the original sources in the child to avoid leaks (once per descriptor)
+        for (int i = 0; i < 3 && r == 0; ++i) {
+            if (src[i] <= 2) continue;
+            bool seen = false;
+            for (int j = 0; j < i; ++j) seen = seen || (src[j] == src[i]);
+            if (!seen) r = ::posix_spawn_file_actions_addclose(&fa, src[i]);
+        }
+#if defined(TINYPROC_HAS_SPAWN_CLOSEFROM)
+        if (r == 0 && opt.close_other_fds)
+            r = ::posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+#endif
+#if defined(TINYPROC_HAS_SPAWN_CHDIR)
+        if (r == 0 && !opt.chdir_to.empty())
+            r = ::posix_spawn_file_actions_addchdir_np(&fa, opt.chdir_to.c_str());
+#endif
+        if (r == 0 && opt.setpgid) {
+            r = ::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+            if (r == 0) r = ::posix_spawnattr_setpgroup(&attr, opt.pgid);
+        }
+        if (r == 0) {
+            char* const* envp = plan.envp.empty() ? environ : &plan.envp[0];
+            if (plan.exec_path)
+                r = ::posix_spawn(pid, plan.exec_path, &fa, &attr, plan.argv, envp);
+            else if (std::strchr(plan.argv[0], '/'))
+                r = ::posix_spawn(pid, plan.argv[0], &fa, &attr, plan.argv, envp);
+            else
+                r = ::posix_spawnp(pid, plan.argv[0], &fa, &attr, plan.argv, envp);
+
+            // posix_spawn does not run shebang-less scripts; do it as execvp would
+            if (r == ENOEXEC) {
+                std::string script = plan.exec_path ? plan.exec_path : search_path_(plan.argv[0], plan.path);
+                if (!script.empty()) {
+                    plan.sh_argv[1] = &script[0];
+                    r = ::posix_spawn(pid, plan.sh_argv[0], &fa, &attr, &plan.sh_argv[0], envp);
+                    plan.sh_argv[1] = 0;
+                    if (r != 0) r = ENOEXEC;
+                }
+            }
+        }
+        ::posix_spawnattr_destroy(&attr);
+        ::posix_spawn_file_actions_destroy(&fa);
+        return r;
+    }
+
+    // Parent-side PATH lookup for posix_spawn's ENOEXEC fallback: the first
+    // executable regular file, or file itself when it contains a '/'
+    static std::string search_path_(const char* file, const char* path) {
+        if (std::strchr(file, '/')) return file;
+        if (!path) path = "/bin:/usr/bin";
+        for (const char* p = path; ; ) {
+            const char* end = std::strchr(p, ':');
+            std::string dir = end ? std::string(p, end) : std::string(p);
+            std::string cand = (dir.empty() ? std::string(".") : dir) + "/" + file;
+            struct stat st;
+            if (::stat(cand.c_str(), &st) == 0 && S_ISREG(st.st_mode) && ::access(cand.c_str(), X_OK) == 0) return cand;
+            if (!end) break;
+            p = end + 1;
+        }
+        return std::string();
+    }
+
+    // ---- Child side (between fork/clone and exec) ----
+    // Async-signal-safe calls only: after fork() another thread may have held the
+    // malloc lock, and with SPAWN_VFORK the child shares our memory.
+    static void child_exec_(const child_ctx_& c) {
+        if (c.restore_mask) {
+            struct sigaction sa;
+            for (int sig = 1; sig < NSIG; ++sig) {
+                if (::sigaction(sig, 0, &sa) != 0) continue;
+                if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL) continue;
+                std::memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = SIG_DFL;
+                ::sigaction(sig, &sa, 0);
+            }
+            ::sigprocmask(SIG_SETMASK, c.restore_mask, 0);
+        }
+
+        // Move the error pipe, the exec descriptor and any source that a dup2
+        // would overwrite out of the way
+        int exerr_w = c.exerr_w;
+        int exec_fd = c.exec_fd;
+        for (size_t j = 0; j < c.nfds; ++j) {
+            if (c.dst[j] == exerr_w) exerr_w = ::fcntl(exerr_w, F_DUPFD_CLOEXEC, c.min_free);
+            if (exec_fd >= 0 && c.dst[j] == exec_fd) {
+                exec_fd = ::fcntl(exec_fd, F_DUPFD_CLOEXEC, c.min_free);
+                if (exec_fd < 0) write_errno_and_exit_(exerr_w, "fcntl(F_DUPFD_CLOEXEC)");
+            }
+        }
+        for (size_t i = 0; i < c.nfds; ++i) {
+            c.tmp[i] = c.src[i];
+            if (c.src[i] < 0) continue;
+            for (size_t j = 0; j < c.nfds; ++j) {
+                if (j == i || c.dst[j] != c.src[i]) continue;
+                c.tmp[i] = ::fcntl(c.src[i], F_DUPFD_CLOEXEC, c.min_free);
+                if (c.tmp[i] < 0) write_errno_and_exit_(exerr_w, "fcntl(F_DUPFD_CLOEXEC)");
+                break;
+            }
+        }
+
+        // Remap the descriptors
+        for (size_t i = 0; i < c.nfds; ++i) {
+            int fd = c.tmp[i];
+            if (fd < 0) continue;
+            if (fd == c.dst[i]) {
+                // Already in place; only make sure it survives exec
+                int flags = ::fcntl(fd, F_GETFD);
+                if (flags != -1 && (flags & FD_CLOEXEC)) ::fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+            } else if (::dup2(fd, c.dst[i]) == -1) {
+                write_errno_and_exit_(exerr_w, "dup2");
+            }
+        }
+        // Close the original sources to avoid leaks (does not affect the parent)
+        for (size_t i = 0; i < c.nfds; ++i) {
+            if (c.src[i] <= 2) continue;
+            bool keep = false;
+            for (size_t j = 0; j < c.nfds && !keep; ++j) keep = (c.dst[j] == c.src[i]);
+            for (size_t j = 0; j < c.nkeep && !keep; ++j) keep = (c.keep[j] == c.src[i]);
+            if (!keep) ::close(c.src[i]);
+        }
+
+        if (c.close_others) close_other_fds_(c, exerr_w, exec_fd);
+        for (size_t j = 0; j < c.nkeep; ++j) {
+            int flags = ::fcntl(c.keep[j], F_GETFD);
+            if (flags == -1) write_errno_and_exit_(exerr_w, "inherit_fds");
+            if (flags & FD_CLOEXEC) ::fcntl(c.keep[j], F_SETFD, flags & ~FD_CLOEXEC);
+        }
+
+        if (c.chdir_to && ::chdir(c.chdir_to) != 0) write_errno_and_exit_(exerr_w, "chdir");
+
+        // 0 means use our own PID
+        if (c.setpgid && ::setpgid(0, c.pgid) != 0) write_errno_and_exit_(exerr_w, "setpgid");
+
+        if (exec_fd >= 0) {
+            exec_fd_(exec_fd, c.argv, c.envp);
+            if (errno == ENOEXEC && c.exec_path) exec_sh_(c, c.exec_path);
+        } else if (c.exec_path) {
+            ::execve(c.exec_path, c.argv, c.envp);
+            if (errno == ENOEXEC) exec_sh_(c, c.exec_path);
+        } else {
+            exec_search_(c, c.argv[0]);
+        }
+        write_errno_and_exit_(exerr_w, "execve");
+    }
+
+    // Whether the child must keep fd open up to (and, except for exerr_w/exec_fd, past) exec
+    static bool child_keeps_(const child_ctx_& c, int fd, int exerr_w, int exec_fd) {
+        if (fd <= 2 || fd == exerr_w || fd == exec_fd) return true;
+        for (size_t j = 0; j < c.nfds; ++j) if (c.dst[j] == fd) return true;
+        for (size_t j = 0; j < c.nkeep; ++j) if (c.keep[j] == fd) return true;
+        return false;
+    }
+
+    // Lowest descriptor >= from that child_keeps_() (-1: none)
+    static int lowest_kept_from_(const child_ctx_& c, int from, int exerr_w, int exec_fd) {
+        int best = -1;
+        for (size_t j = 0; j < c.nfds + c.nkeep + 2; ++j) {
+            int fd;
+            if (j < c.nfds)                 fd = c.dst[j];
+            else if (j < c.nfds + c.nkeep)  fd = c.keep[j - c.nfds];
+            else if (j == c.nfds + c.nkeep) fd = exerr_w;
+            else                            fd = exec_fd;
+            if (fd >= from && (best < 0 || fd < best)) best = fd;
+        }
+        return best;
+    }
+
+    // Child side of options.close_other_fds: async-signal-safe, no allocation
+    static void close_other_fds_(const child_ctx_& c, int exerr_w, int exec_fd) {
+#if defined(__linux__) && defined(SYS_close_range)
+        // Linux 5.11+: flag everything CLOEXEC in one call. The descriptors used up
+        // to exec are CLOEXEC already; dst[] is cleared again here and keep[] by the caller.
+        if (::syscall(SYS_close_range, 3u, ~0u, (unsigned)CLOSE_RANGE_CLOEXEC) == 0) {
+            for (size_t j = 0; j < c.nfds; ++j) {
+                if (c.dst[j] <= 2 || c.tmp[j] < 0) continue;
+                int flags = ::fcntl(c.dst[j], F_GETFD);
+                if (flags != -1) ::fcntl(c.dst[j], F_SETFD, flags & ~FD_CLOEXEC);
+            }
+            return;
+        }
+        // Linux 5.9+: close the gaps between the descriptors we keep
+        if (errno == EINVAL) {
+            unsigned lo = 3;
+            for (;;) {
+                int next = lowest_kept_from_(c, (int)lo, exerr_w, exec_fd);
+                if (next < 0) {
+                    ::syscall(SYS_close_range, lo, ~0u, 0u);
+                    return;
+                }
+                if ((unsigned)next > lo) ::syscall(SYS_close_range, lo, (unsigned)next - 1, 0u);
+                lo = (unsigned)next + 1;
+            }
+        }
+#endif
+#if defined(__linux__) && defined(SYS_getdents64)
+        // Older kernels: walk /proc/self/fd, so the cost follows the open descriptors
+        // rather than the size of the table. Repeat until a pass closes nothing, since
+        // closing entries while reading the directory may skip some.
+        int dfd = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd != -1) {
+            bool closed = true;
+            while (closed) {
+                closed = false;
+                ::lseek(dfd, 0, SEEK_SET);
+                char buf[4096];
+                long n;
+                while ((n = ::syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0) {
+                    for (long off = 0; off < n; ) {
+                        unsigned short reclen;
+                        std::memcpy(&reclen, buf + off + 16, sizeof(reclen)); // linux_dirent64::d_reclen
+                        const char* name = buf + off + 19;                     // linux_dirent64::d_name
+                        off += reclen;
+                        if (name[0] < '0' || name[0] > '9') continue;
+                        int fd = 0;
+                        for (const char* q = name; *q >= '0' && *q <= '9'; ++q) fd = fd * 10 + (*q - '0');
+                        if (fd == dfd || child_keeps_(c, fd, exerr_w, exec_fd)) continue;
+                        ::close(fd);
+                        closed = true;
+                    }
+                }
+            }
+            ::close(dfd);
+            return;
+        }
+#endif
+        long max = ::sysconf(_SC_OPEN_MAX);
+        if (max < 0 || max > 65536) max = 65536;
+        for (int fd = 3; fd < max; ++fd)
+            if (!child_keeps_(c, fd, exerr_w, exec_fd)) ::close(fd);
+    }
+
+    static void exec_fd_(int fd, char* const* argv, char* const* envp) {
+#if defined(__linux__) && defined(SYS_execveat)
+        ::syscall(SYS_execveat, fd, "", argv, envp, AT_EMPTY_PATH);
+        if (errno != ENOSYS) return;
+#endif
+        ::fexecve(fd, argv, envp);
+    }
+
+    // Child side of the ENOEXEC fallback; leaves errno at ENOEXEC if /bin/sh fails too
+    static void exec_sh_(const child_ctx_& c, const char* file) {
+        if (!c.sh_argv) return;
+        c.sh_argv[1] = const_cast<char*>(file);
+        ::execve(c.sh_argv[0], c.sh_argv, c.envp);
+        errno = ENOEXEC;
+    }
+
+    // execvpe without the allocations: walk PATH with a stack buffer.
+    // Like execvp, a candidate that is not executable (EACCES) does not stop the search,
+    // and one without a recognized format (ENOEXEC) is run through /bin/sh.
+    static void exec_search_(const child_ctx_& c, const char* file) {
+        char* const* argv = c.argv;
+        char* const* envp = c.envp;
+        const char* path = c.path;
+        if (std::strchr(file, '/')) {
+            ::execve(file, argv, envp);
+            if (errno == ENOEXEC) exec_sh_(c, file);
+            return;
+        }
+        if (!path) path = "/bin:/usr/bin";
+
+        char buf[PATH_MAX];
+        size_t flen = std::strlen(file);
+        bool saw_eacces = false;
+        for (const char* p = path; ; ) {
+            const char* end = std::strchr(p, ':');
+            size_t dlen = end ? (size_t)(end - p) : std::strlen(p);
+            if (dlen + 1 + flen + 1 <= sizeof(buf)) {
+                size_t n = 0;
+                if (dlen == 0) buf[n++] = '.'; // An empty entry means the current directory
+                else { std::memcpy(buf, p, dlen); n = dlen; }
+                buf[n++] = '/';
+                std::memcpy(buf + n, file, flen + 1);
+                ::execve(buf, argv, envp);
+                if (errno == ENOEXEC) { exec_sh_(c, buf); return; }
+                switch (errno) {
+                case EACCES: saw_eacces = true; break;
+                case ENOENT: case ENOTDIR: case ELOOP: case ENAMETOOLONG: case ESTALE: case ENODEV: case ETIMEDOUT:
+                    break;
+                default:
+                    return; // A real error on an existing file (e.g. E2BIG)
+                }
+            }
+            if (!end) break;
+            p = end + 1;
+        }
+        if (saw_eacces) errno = EACCES;
+    }
+
+    // ---- pidfd ----
+    void open_pidfd_() {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+        // Race-free: the child cannot be reaped behind our back before this point
+        int fd = (int)::syscall(SYS_pidfd_open, pid_, 0); // O_CLOEXEC is implied
+        pidfd_ = (fd >= 0) ? fd : -1;
+#endif
+    }
+    void close_pidfd_() {
+        if (pidfd_ != -1) { ::close(pidfd_); pidfd_ = -1; }
+    }
+
+    int waitid_(siginfo_t& info, int flags) const {
+#if defined(__linux__)
+        if (pidfd_ != -1) {
+            // P_PIDFD (Linux 5.4+); not every libc declares the enumerator
+            int r = ::waitid(static_cast<idtype_t>(3), (id_t)pidfd_, &info, flags);
+            if (r == 0 || errno != EINVAL) return r;
+        }
+#endif
+        return ::waitid(P_PID, (id_t)pid_, &info, flags);
+    }
+
+    // Re-encode a waitid() result the way waitpid() reports it
+    static int status_from_siginfo_(const siginfo_t& info) {
+        switch (info.si_code) {
+        case CLD_EXITED:    return (info.si_status & 0xff) << 8;
+        case CLD_KILLED:    return info.si_status & 0x7f;
+        case CLD_DUMPED:    return (info.si_status & 0x7f) | 0x80;
+        case CLD_STOPPED:
+        case CLD_TRAPPED:   return ((info.si_status & 0xff) << 8) | 0x7f;
+        case CLD_CONTINUED: return 0xffff;
+        default:            return 0;
+        }
+    }
+
+    // ---- util ----
+    void cleanup_parent_fds_() {
+        close_stdin();
+        close_stdout();
+        close_stderr();
+        close_extra_fds_();
+    }
+    void close_extra_fds_() {
+        for (std::map<int, int>::iterator it = extra_.begin(); it != extra_.end(); ++it) {
+            tuners_.erase(it->second);
+            ::close(it->second);
+        }
+        extra_.clear();
+    }
+    static void close_all_(std::vector<int>& fds) {
+        for (size_t i = 0; i < fds.size(); ++i) if (fds[i] != -1) ::close(fds[i]);
+        fds.clear();
+    }
+
+    void set_last_error_(const char* msg, int err) {
+        last_error_msg_ = msg ? msg : "";
         last_errno_ = err;
     }
-    void clear_last_error_() {
-        last_error_msg_.clear();
+    void clear_last_error_() {
+        last_error_msg_.clear();
+        last_errno_ = 0;
+    }
+    bool fail_perror_(const char* where) {
+        char buf[256];
+        std::snprintf(buf, sizeof(buf), "%s: %s", where, std::strerror(errno));
+        set_last_error_(buf, errno);
+        return false;
+    }
+
+    static void safe_close_(int fd, bool do_close) {
+        if (do_close && fd >= 0) { ::close(fd); }
+    }
+    static void safe_close_pair_(int p[2]) {
+        if (p[0] != -1) ::close(p[0]);
+        if (p[1] != -1) ::close(p[1]);
+        p[0] = p[1] = -1;
+    }
+    // ---- Pipe sizing ----
+    static int pipe_max_size_() {
+        // Threads racing on the first call all compute the same value
+        static int cached = 0;
+        int c = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+        if (c > 0) return c;
+        int v = 1024 * 1024;
+        FILE* f = std::fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f) {
+            int x;
+            if (std::fscanf(f, "%d", &x) == 1 && x > 0) v = x;
+            std::fclose(f);
+        }
+        __atomic_store_n(&cached, v, __ATOMIC_RELAXED);
+        return v;
+    }
+
+    // Returns the resulting capacity, or -1 if it could not be changed
+    static int set_pipe_size_(int fd, size_t want) {
+#if defined(F_SETPIPE_SZ)
+        int max = pipe_max_size_();
+        return ::fcntl(fd, F_SETPIPE_SZ, (want > (size_t)max) ? max : (int)want);
+#else
+        (void)fd; (void)want;
+        return -1;
+#endif
+    }
+
+    // Initial size for a new pipe; failure (e.g. the per-user pipe quota) keeps the default
+    static void size_pipe_(int fd, const stream_spec& s, bool parent_reads) {
+        if (s.adaptive && parent_reads)
+            set_pipe_size_(fd, s.capacity ? s.capacity : 16 * 1024);
+        else if (s.capacity)
+            set_pipe_size_(fd, s.capacity);
+    }
+
+    void track_pipe_(int fd) {
+#if defined(F_GETPIPE_SZ)
+        pipe_tuner_ t;
+        t.cap = ::fcntl(fd, F_GETPIPE_SZ);
+        if (t.cap <= 0) return;
+        t.min_cap = (int)::sysconf(_SC_PAGESIZE);
+        t.full = t.idle = 0;
+        ::clock_gettime(CLOCK_MONOTONIC, &t.busy);
+        tuners_[fd] = t;
+#else
+        (void)fd;
+#endif
+    }
+
+    ssize_t tuned_read_(int fd, void* buf, size_t len) {
+        ssize_t n = retry_eintr_read_(fd, buf, len);
+        if (n > 0 && !tuners_.empty()) tune_pipe_(fd, (size_t)n);
+        return n;
+    }
+
+    // What was in the pipe before this read (FIONREAD + n) tells whether the
+    // writer was blocked on it or the pipe barely sees use
+    void tune_pipe_(int fd, size_t n) {
+        std::map<int, pipe_tuner_>::iterator it = tuners_.find(fd);
+        if (it == tuners_.end()) return;
+        pipe_tuner_& t = it->second;
+        int pending = 0;
+        if (::ioctl(fd, FIONREAD, &pending) != 0) return;
+        size_t level = n + (size_t)pending;
+        if (level >= (size_t)t.cap / 16) ::clock_gettime(CLOCK_MONOTONIC, &t.busy);
+        if (level >= (size_t)t.cap) {
+            t.idle = 0;
+            if (++t.full >= 4 && t.cap < pipe_max_size_()) {
+                int r = set_pipe_size_(fd, (size_t)t.cap * 2);
+                if (r > 0) t.cap = r;
+                t.full = 0;
+            }
+        } else if (level < (size_t)t.cap / 16) {
+            t.full = 0;
+            if (++t.idle >= 64 && t.cap > t.min_cap) {
+                // EBUSY if more data is buffered than the new size holds: try again later
+                int r = set_pipe_size_(fd, (size_t)std::max(t.cap / 2, t.min_cap));
+                if (r > 0) t.cap = r;
+                t.idle = 0;
+            }
+        } else {
+            t.full = t.idle = 0;
+        }
+    }
+
+    // ---- tee sinks ----
+    void setup_tee_(tee_state_& t, const std::vector<int>& sinks, int src, bool nonblock) {
+        t.reset();
+        if (sinks.empty() || src == -1) return;
+        t.sinks = sinks;
+        t.nonblock = nonblock;
+#if defined(__linux__)
+        // The staging pipe matches the source, so one tee(2) holds a full batch
+        if (pipe_cloexec_(t.stage) == 0) {
+#  if defined(F_GETPIPE_SZ)
+            int cap = ::fcntl(src, F_GETPIPE_SZ);
+            if (cap > 0) set_pipe_size_(t.stage[1], (size_t)cap);
+#  endif
+        }
+#endif
+    }
+
+    void drop_sink_(tee_state_& t, size_t i, int e) {
+        char buf[128];
+        std::snprintf(buf, sizeof(buf), "tee sink fd %d dropped: %s", t.sinks[i], std::strerror(e));
+        set_last_error_(buf, e);
+        t.sinks[i] = -1;
+    }
+
+    // Blocks SIGPIPE in the calling thread, so writing to a pipe the child closed
+    // fails with EPIPE instead of killing us. On scope exit, a SIGPIPE raised
+    // meanwhile is consumed and the previous mask restored.
+    class sigpipe_guard_ {
+    public:
+        sigpipe_guard_() {
+            sigemptyset(&set_);
+            sigaddset(&set_, SIGPIPE);
+            ::pthread_sigmask(SIG_BLOCK, &set_, &old_);
+        }
+        ~sigpipe_guard_() {
+            int e = errno;
+            if (!sigismember(&old_, SIGPIPE)) {
+                sigset_t pending;
+                if (::sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE)) {
+                    struct timespec zero = { 0, 0 };
+                    while (::sigtimedwait(&set_, 0, &zero) == -1 && errno == EINTR) {}
+                }
+            }
+            ::pthread_sigmask(SIG_SETMASK, &old_, 0);
+            errno = e;
+        }
+    private:
+        sigset_t set_, old_;
+        sigpipe_guard_(const sigpipe_guard_&);
+        sigpipe_guard_& operator=(const sigpipe_guard_&);
+    };
+
+    static bool write_full_(int fd, const char* p, size_t len) {
+        while (len) {
+            ssize_t n = ::write(fd, p, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    struct pollfd pfd = { fd, POLLOUT, 0 };
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                return false;
+            }
+            p += n;
+            len -= (size_t)n;
+        }
+        return true;
+    }
+
+    // Copy up to len bytes at the head of src into every sink except `skip`
+    // without consuming them. Returns the batch size (the same for every sink),
+    // 0 at EOF, -1 on error, or -2 when there is no sink to feed.
+    ssize_t tee_to_sinks_(tee_state_& t, int src, size_t len, size_t skip) {
+        ssize_t m = -2;
+#if defined(__linux__)
+        unsigned fl = t.nonblock ? SPLICE_F_NONBLOCK : 0u;
+        for (size_t i = 0; i < t.sinks.size(); ++i) {
+            if (i == skip || t.sinks[i] == -1) continue;
+            if (t.stage[1] == -1) { drop_sink_(t, i, EMFILE); continue; }
+            // The staging pipe is empty and as large as src, so after the first
+            // sink tee(2) returns the same m every time
+            ssize_t k;
+            do { k = ::tee(src, t.stage[1], (m < 0) ? len : (size_t)m, fl); } while (k < 0 && errno == EINTR);
+            if (k <= 0) return (m > 0) ? m : k;
+            if (m < 0) m = k;
+            for (ssize_t left = k; left > 0; ) {
+                ssize_t n = ::splice(t.stage[0], 0, t.sinks[i], 0, (size_t)left, SPLICE_F_MOVE);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    struct pollfd pfd = { t.sinks[i], POLLOUT, 0 };
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                if (n <= 0) {
+                    drop_sink_(t, i, n < 0 ? errno : EPIPE);
+                    char scratch[4096]; // Empty the staging pipe for the next sink
+                    while (left > 0 && (n = ::read(t.stage[0], scratch, std::min((size_t)left, sizeof(scratch)))) > 0) left -= n;
+                    break;
+                }
+                left -= n;
+            }
+        }
+#else
+        (void)t; (void)src; (void)len; (void)skip;
+#endif
+        return m;
+    }
+
+    ssize_t tee_read_(tee_state_& t, int src, void* buf, size_t len) {
+#if defined(__linux__)
+        ssize_t m = tee_to_sinks_(t, src, len, (size_t)-1);
+        if (m == -2) return tuned_read_(src, buf, len);
+        if (m <= 0) { if (m < 0) set_last_error_("tee", errno); return m; }
+        // The batch is already in the pipe, so this returns exactly m bytes
+        return tuned_read_(src, buf, (size_t)m);
+#else
+        ssize_t n = tuned_read_(src, buf, len);
+        for (size_t i = 0; n > 0 && i < t.sinks.size(); ++i)
+            if (t.sinks[i] != -1 && !write_full_(t.sinks[i], static_cast<const char*>(buf), (size_t)n)) drop_sink_(t, i, errno);
+        return n;
+#endif
+    }
+
+    // read_stdout()/read_stderr() under an output_limit (see output_limit for the policies)
+    ssize_t limited_read_(limit_state_& l, tee_state_& t, int fd, void* buf, size_t len) {
+        const output_limit& lim = l.limit;
+        output_limit_stats& st = l.stats;
+        if (len == 0) return 0;
+        for (;;) {
+            if (st.killed || (lim.max_bytes && st.delivered >= lim.max_bytes)) {
+                if (lim.policy == output_limit::BACKPRESSURE) {
+                    ++st.bytes_hits;
+                    set_last_error_("output byte limit reached", ENOBUFS);
+                    errno = ENOBUFS;
+                    return -1;
+                }
+                // Over the cap: drain to EOF without handing anything out
+                ssize_t n = t.active() ? tee_read_(t, fd, buf, len) : tuned_read_(fd, buf, len);
+                if (n <= 0) return n;
+                st.discarded += (uint64_t)n;
+                continue;
+            }
+
+            size_t allow = len;
+            bool by_bytes = false, by_rate = false;
+            if (lim.max_bytes && lim.max_bytes - st.delivered < (uint64_t)allow) {
+                allow = (size_t)(lim.max_bytes - st.delivered);
+                by_bytes = true;
+            }
+            if (lim.max_rate) {
+                l.refill();
+                if (l.tokens < (double)allow) {
+                    allow = (size_t)l.tokens;
+                    by_rate = true;
+                    by_bytes = false;
+                }
+                if (allow == 0 && lim.policy == output_limit::BACKPRESSURE) {
+                    // Wait until a ~1/64 s slice of the budget (or the whole request) is back
+                    double need = std::max(1.0, std::min((double)len, (double)lim.max_rate / 64));
+                    ++st.rate_hits;
+                    int fl = ::fcntl(fd, F_GETFL);
+                    if (fl != -1 && (fl & O_NONBLOCK)) {
+                        // Never sleep on a non-blocking stream: the caller may be an
+                        // event loop serving others (see stdout_limit_wait_ms())
+                        l.need = need;
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                    double ns = (need - l.tokens) * 1e9 / (double)lim.max_rate;
+                    struct timespec ts;
+                    ts.tv_sec = (time_t)(ns / 1e9);
+                    ts.tv_nsec = (long)(ns - (double)ts.tv_sec * 1e9);
+                    st.throttled_ns += (uint64_t)ns;
+                    ::nanosleep(&ts, 0);
+                    continue;
+                }
+                l.need = 0;
+            }
+
+            // BACKPRESSURE leaves the excess in the pipe; TRUNCATE/KILL read it and drop it
+            size_t want = (lim.policy == output_limit::BACKPRESSURE) ? allow : len;
+            ssize_t n = t.active() ? tee_read_(t, fd, buf, want) : tuned_read_(fd, buf, want);
+            if (n <= 0) return n;
+            size_t keep = std::min((size_t)n, allow);
+            if (lim.policy == output_limit::BACKPRESSURE) {
+                if ((size_t)n == want && want < len) { if (by_rate) ++st.rate_hits; else if (by_bytes) ++st.bytes_hits; }
+            } else if (keep < (size_t)n) {
+                if (by_rate) ++st.rate_hits; else ++st.bytes_hits;
+                st.discarded += (uint64_t)((size_t)n - keep);
+                if (lim.policy == output_limit::KILL && !st.killed) {
+                    st.killed = true;
+                    kill_group_(SIGKILL);
+                }
+            }
+            st.delivered += (uint64_t)keep;
+            if (lim.max_rate) l.tokens -= (double)keep;
+            if (keep > 0) return (ssize_t)keep;
+        }
+    }
+
+    ssize_t limited_readv_(limit_state_& l, tee_state_& t, int fd, const struct iovec* iov, int iovcnt) {
+        for (int i = 0; i < iovcnt; ++i)
+            if (iov[i].iov_len) return limited_read_(l, t, fd, iov[i].iov_base, iov[i].iov_len);
+        return 0;
+    }
+
+    // Signal the child's process group when it has one, else the child
+    void kill_group_(int sig) {
+        if (pid_ <= 0) return;
+        if (pgid_ > 0 && ::kill(-pgid_, sig) == 0) return;
+        kill(sig);
+    }
+
+    ssize_t pump_(tee_state_& t, int src, size_t len) {
+        size_t last = t.sinks.size();
+        for (size_t i = 0; i < t.sinks.size(); ++i) if (t.sinks[i] != -1) last = i;
+        if (last == t.sinks.size()) { set_last_error_("no tee sinks", EBADF); return -1; }
+#if defined(__linux__)
+        // Every sink but the last gets a tee(2) copy; the last one consumes the batch
+        ssize_t m = tee_to_sinks_(t, src, len, last);
+        if (m == 0 || m == -1) { if (m < 0) set_last_error_("tee", errno); return m; }
+        unsigned fl = t.nonblock ? SPLICE_F_NONBLOCK : 0u;
+        if (m == -2) {
+            ssize_t n;
+            do { n = ::splice(src, 0, t.sinks[last], 0, len, SPLICE_F_MOVE | fl); } while (n < 0 && errno == EINTR);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) drop_sink_(t, last, errno);
+            else if (n < 0) set_last_error_("splice", errno);
+            return n;
+        }
+        for (ssize_t left = m; left > 0; ) {
+            ssize_t n = ::splice(src, 0, t.sinks[last], 0, (size_t)left, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd pfd = { t.sinks[last], POLLOUT, 0 };
+                ::poll(&pfd, 1, -1);
+                continue;
+            }
+            if (n <= 0) {
+                // The batch must still leave src, or the other sinks would see it twice
+                drop_sink_(t, last, n < 0 ? errno : EPIPE);
+                char scratch[4096];
+                while (left > 0 && (n = ::read(src, scratch, std::min((size_t)left, sizeof(scratch)))) > 0) left -= n;
+                break;
+            }
+            left -= n;
+        }
+        return m;
+#else
+        char buf[64 * 1024];
+        ssize_t n = retry_eintr_read_(src, buf, std::min(len, sizeof(buf)));
+        for (size_t i = 0; n > 0 && i < t.sinks.size(); ++i)
+            if (t.sinks[i] != -1 && !write_full_(t.sinks[i], buf, (size_t)n)) drop_sink_(t, i, errno);
+        return n;
+#endif
+    }
+
+    static int pipe_cloexec_(int p[2]) {
+#if defined(__linux__)
+        // Atomic, so a concurrent fork in another thread cannot inherit the ends
+        return ::pipe2(p, O_CLOEXEC);
+#else
+        if (::pipe(p) != 0) return -1;
+        set_cloexec_(p[0]);
+        set_cloexec_(p[1]);
+        return 0;
+#endif
+    }
+    static int set_cloexec_(int fd) {
+        if (fd < 0) return -1;
+        int flags = ::fcntl(fd, F_GETFD);
+        if (flags == -1) return -1;
+        return ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+    }
+    static int set_nonblock_(int fd, bool on) {
+        if (fd < 0) return -1;
+        int flags = ::fcntl(fd, F_GETFL);
+        if (flags == -1) return -1;
+        if (on) flags |= O_NONBLOCK;
+        else    flags &= ~O_NONBLOCK;
+        return ::fcntl(fd, F_SETFL, flags);
+    }
+    // Copy fallback for feed_stdin_from_fd. Everything read is written: when
+    // nonblocking, a chunk is only read once the pipe has room and is kept to
+    // PIPE_BUF, which a pipe with room accepts whole.
+    ssize_t copy_to_stdin_(int fd, off_t* offp, size_t len, bool nonblock) {
+        char buf[64 * 1024];
+        if (len > sizeof(buf)) len = sizeof(buf);
+        if (nonblock) {
+            struct pollfd pfd = { in_w_, POLLOUT, 0 };
+            if (::poll(&pfd, 1, 0) == 0) { errno = EAGAIN; return -1; }
+            if (len > PIPE_BUF) len = PIPE_BUF;
+        }
+        ssize_t n = offp ? ::pread(fd, buf, len, *offp) : ::read(fd, buf, len);
+        if (n <= 0) return n;
+        for (ssize_t w = 0; w < n; ) {
+            ssize_t r = ::write(in_w_, buf + w, (size_t)(n - w));
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    struct pollfd pfd = { in_w_, POLLOUT, 0 };
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                return -1;
+            }
+            w += r;
+        }
+        if (offp) *offp += n;
+        return n;
+    }
+
+    static ssize_t retry_eintr_read_(int fd, void* buf, size_t len) {
+        for (;;) {
+            ssize_t n = ::read(fd, buf, len);
+            if (n < 0 && errno == EINTR) continue;
+            return n;
+        }
+    }
+    static ssize_t retry_eintr_write_(int fd, const void* buf, size_t len) {
+        const char* p = static_cast<const char*>(buf);
+        size_t left = len;
+        while (left) {
+            ssize_t n = ::write(fd, p, left);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return n; // Error
+            }
+            left -= (size_t)n;
+            p += n;
+        }
+        return (ssize_t)len;
+    }
+    // Milliseconds left until t0 + timeout_ms (-1: no deadline, 0: expired)
+    static int remaining_ms_(const struct timespec& t0, int timeout_ms) {
+        if (timeout_ms < 0) return -1;
+        struct timespec now;
+        ::clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (long)(now.tv_sec - t0.tv_sec) * 1000 + (now.tv_nsec - t0.tv_nsec) / 1000000;
+        return (elapsed >= timeout_ms) ? 0 : (int)(timeout_ms - elapsed);
+    }
+
+    // communicate(): append what is available to dst (NULL: drop it). Reads go
+    // through a stack buffer and append(), so growing dst never zero-fills a
+    // tail that is then cut off. Returns false at EOF or on error (errno is
+    // ENOBUFS when a BACKPRESSURE max_bytes was reached).
+    bool drain_into_(int fd, std::string* dst, size_t& count) {
+        char buf[64 * 1024];
+        for (;;) {
+            ssize_t n = (fd == out_r_) ? read_stdout(buf, sizeof(buf)) : read_stderr(buf, sizeof(buf));
+            if (n > 0) {
+                if (dst) dst->append(buf, (size_t)n);
+                count += (size_t)n;
+                if ((size_t)n < sizeof(buf)) return true; // Pipe drained for now
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (n == 0) errno = 0;
+            return false;
+        }
+    }
+
+    static int iov_max_() {
+#if defined(IOV_MAX)
+        return IOV_MAX;
+#else
+        return 16;
+#endif
+    }
+
+    static ssize_t retry_eintr_writev_(int fd, const struct iovec* iov, int iovcnt) {
+        size_t total = 0;
+        int i = 0;
+        size_t skip = 0; // Bytes of iov[i] already written
+        while (i < iovcnt) {
+            if (iov[i].iov_len == skip) { ++i; skip = 0; continue; }
+            ssize_t n;
+            if (skip == 0) {
+                n = ::writev(fd, iov + i, std::min(iovcnt - i, iov_max_()));
+            } else {
+                // Resume inside iov[i]: a short stack copy of the next few entries
+                struct iovec head[16];
+                int k = std::min(iovcnt - i, 16);
+                std::memcpy(head, iov + i, sizeof(struct iovec) * (size_t)k);
+                head[0].iov_base = static_cast<char*>(head[0].iov_base) + skip;
+                head[0].iov_len -= skip;
+                n = ::writev(fd, head, k);
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (total > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return (ssize_t)total;
+                return n;
+            }
+            total += (size_t)n;
+            // Advance (i, skip) by n bytes
+            size_t left = (size_t)n;
+            while (left > 0 && i < iovcnt) {
+                size_t room = iov[i].iov_len - skip;
+                if (left < room) { skip += left; left = 0; }
+                else { left -= room; ++i; skip = 0; }
+            }
+        }
+        return (ssize_t)total;
+    }
+
+    ssize_t tuned_readv_(tee_state_& t, int fd, const struct iovec* iov, int iovcnt) {
+        if (iovcnt > iov_max_()) iovcnt = iov_max_();
+        if (!t.active()) {
+            ssize_t n;
+            do { n = ::readv(fd, iov, iovcnt); } while (n < 0 && errno == EINTR);
+            if (n > 0 && !tuners_.empty()) tune_pipe_(fd, (size_t)n);
+            return n;
+        }
+        // Tee sinks: each entry is one tee_read_ batch; entries after the first only
+        // take data that is already buffered, so the call blocks at most once
+        ssize_t got = 0;
+        for (int i = 0; i < iovcnt; ++i) {
+            if (iov[i].iov_len == 0) continue;
+            if (got > 0) {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if (::poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) break;
+            }
+            ssize_t n = tee_read_(t, fd, iov[i].iov_base, iov[i].iov_len);
+            if (n <= 0) return (got > 0) ? got : n;
+            got += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return got;
+    }
+
+    static ssize_t read_full_errno_(int fd, void* buf, size_t len) {
+        // On successful exec, CLOEXEC should cause an immediate EOF (0).
+        // On failure, errno (as int) is written.
+        char* p = static_cast<char*>(buf);
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = ::read(fd, p + got, len - got);
+            if (n == 0) break;           // EOF
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return n;
+            }
+            got += (size_t)n;
+        }
+        return (ssize_t)got;
+    }
+    static void write_errno_and_exit_(int fd, const char* where) {
+        (void)where; // where is available for debugging if needed
+        int e = errno;
+        // Best effort: write errno back to the parent
+        (void)::write(fd, &e, sizeof(e));
+        _exit(127);
+    }
+};
+
+// Fork server ("zygote") for popen3 (options.server, Linux only).
+// start() forks a small helper while the process is still small and, ideally,
+// single-threaded. popen3::start then sends argv/envp and the child's stdio
+// descriptors over a Unix socket (SCM_RIGHTS). The helper forks the child with
+// CLONE_PARENT, so the child is still *our* child: wait(), kill(), the pidfd
+// and the pipes behave exactly as with a direct spawn, and the spawn cost no
+// longer depends on this process's memory footprint or thread count.
+class spawn_server {
+public:
+    spawn_server() : pid_(-1), sock_(-1), last_errno_(0) { ::pthread_mutex_init(&mu_, 0); }
+    ~spawn_server() { stop(); ::pthread_mutex_destroy(&mu_); }
+
+    bool start() {
+        last_error_msg_.clear(); last_errno_ = 0;
+        if (sock_ != -1) return true;
+#if defined(__linux__)
+        int sv[2];
+        if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) return fail_("socketpair", errno);
+        pid_t p = ::fork();
+        if (p < 0) { int e = errno; ::close(sv[0]); ::close(sv[1]); return fail_("fork", e); }
+        if (p == 0) {
+            ::close(sv[0]);
+            serve_(sv[1]);
+            _exit(0);
+        }
+        ::close(sv[1]);
+        sock_ = sv[0];
+        pid_ = p;
+        return true;
+#else
+        return fail_("spawn_server requires Linux (CLONE_PARENT)", ENOSYS);
+#endif
+    }
+
+    // Closing the socket makes the helper exit; reap it
+    void stop() {
+        if (sock_ != -1) { ::close(sock_); sock_ = -1; }
+        if (pid_ > 0) {
+            int st;
+            while (::waitpid(pid_, &st, 0) == -1 && errno == EINTR) {}
+            pid_ = -1;
+        }
+    }
+
+    bool running() const { return sock_ != -1; }
+    pid_t pid() const { return pid_; }
+
+    const std::string& last_error() const { return last_error_msg_; }
+    int last_errno() const { return last_errno_; }
+
+private:
+    friend class popen3;
+
+    pid_t pid_;
+    int sock_;
+    pthread_mutex_t mu_;
+    std::string last_error_msg_;
+    int last_errno_;
+
+    spawn_server(const spawn_server&);
+    spawn_server& operator=(const spawn_server&);
+
+    enum { MAX_FDS = 250 }; // Below SCM_MAX_FD
+
+    // Request layout: header, dst[nfds], then NUL-terminated strings
+    // (argv, envp, [chdir], [exec_path], [path]). Sources travel as SCM_RIGHTS,
+    // in dst order, followed by the exec descriptor when there is one.
+    struct request_ {
+        int nfds;
+        int has_exec_fd;
+        int setpgid;
+        pid_t pgid;
+        unsigned argc, envc;
+        int has_chdir, has_exec_path, has_path;
+        sigset_t mask;       // Signal mask of the calling thread, given to the child
+    };
+    struct reply_ {
+        int err;             // errno of a failed spawn/exec (0: exec succeeded)
+        pid_t pid;           // Child PID (> 0 even when exec failed: reap it)
+    };
+
+    bool fail_(const char* where, int e) {
+        char buf[256];
+        std::snprintf(buf, sizeof(buf), "%s: %s", where, std::strerror(e));
+        last_error_msg_ = buf;
+        last_errno_ = e;
+        return false;
+    }
+
+    static void put_str_(std::vector<char>& m, const char* s) { m.insert(m.end(), s, s + std::strlen(s) + 1); }
+
+    // Client side. Returns false (errno set) when the helper could not be reached;
+    // otherwise *exec_err holds the child's exec errno (0 on success).
+    bool spawn_(char* const* argv, char* const* envp, const char* chdir_to, bool setpgid, pid_t pgid,
+                const char* exec_path, int exec_fd, const char* path,
+                const int* src, const int* dst, size_t nfds, pid_t* pid, int* exec_err) {
+        std::vector<int> fds, dsts;
+        for (size_t i = 0; i < nfds; ++i) {
+            int s = src[i];
+            // An inherited stdio stream forwards our current descriptor, not the helper's
+            if (s < 0 && dst[i] <= 2 && ::fcntl(dst[i], F_GETFD) != -1) s = dst[i];
+            if (s < 0) continue;
+            fds.push_back(s);
+            dsts.push_back(dst[i]);
+        }
+        if (exec_fd >= 0) fds.push_back(exec_fd);
+        if (fds.size() > MAX_FDS) { errno = EMFILE; return false; }
+
+        request_ h;
+        std::memset(&h, 0, sizeof(h));
+        h.nfds = (int)dsts.size();
+        h.has_exec_fd = (exec_fd >= 0);
+        h.setpgid = setpgid;
+        h.pgid = pgid;
+        h.has_chdir = (chdir_to != 0);
+        h.has_exec_path = (exec_path != 0);
+        h.has_path = (path != 0);
+        ::sigprocmask(SIG_SETMASK, 0, &h.mask);
+        for (char* const* a = argv; *a; ++a) ++h.argc;
+        for (char* const* e = envp; e && *e; ++e) ++h.envc;
+
+        std::vector<char> m(sizeof(h));
+        std::memcpy(&m[0], &h, sizeof(h));
+        if (!dsts.empty()) {
+            const char* d = reinterpret_cast<const char*>(&dsts[0]);
+            m.insert(m.end(), d, d + dsts.size() * sizeof(int));
+        }
+        for (unsigned i = 0; i < h.argc; ++i) put_str_(m, argv[i]);
+        for (unsigned i = 0; i < h.envc; ++i) put_str_(m, envp[i]);
+        if (chdir_to)  put_str_(m, chdir_to);
+        if (exec_path) put_str_(m, exec_path);
+        if (path)      put_str_(m, path);
+
+        union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)]; struct cmsghdr align; } ctl;
+        struct iovec iov = { &m[0], m.size() };
+        struct msghdr mh;
+        std::memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        if (!fds.empty()) {
+            mh.msg_control = ctl.buf;
+            mh.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            std::memcpy(CMSG_DATA(cm), &fds[0], sizeof(int) * fds.size());
+        }
+
+        reply_ r;
+        ::pthread_mutex_lock(&mu_);
+        ssize_t n;
+        do { n = ::sendmsg(sock_, &mh, MSG_NOSIGNAL); } while (n < 0 && errno == EINTR);
+        if (n >= 0) {
+            do { n = ::recv(sock_, &r, sizeof(r), 0); } while (n < 0 && errno == EINTR);
+            if (n >= 0 && n != (ssize_t)sizeof(r)) { n = -1; errno = EPIPE; } // Helper went away
+        }
+        int e = errno;
+        ::pthread_mutex_unlock(&mu_);
+        if (n < 0) { errno = e; return false; }
+        *pid = r.pid;
+        *exec_err = r.err;
+        return true;
+    }
+
+#if defined(__linux__)
+    // ---- Helper process ----
+    static void serve_(int sock) {
+        // Our handlers make no sense here, and the helper must not keep other descriptors alive
+        struct sigaction sa;
+        for (int sig = 1; sig < NSIG; ++sig) {
+            if (::sigaction(sig, 0, &sa) != 0) continue;
+            if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL) continue;
+            std::memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = SIG_DFL;
+            ::sigaction(sig, &sa, 0);
+        }
+        close_fds_except_(sock);
+
+        std::vector<char> m;
+        std::vector<char*> argv, envp;
+        std::vector<int> tmp;
+        union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)]; struct cmsghdr align; } ctl;
+        for (;;) {
+            ssize_t len = ::recv(sock, 0, 0, MSG_PEEK | MSG_TRUNC);
+            if (len == 0) return;  // Owner closed the socket
+            if (len < 0) { if (errno == EINTR) continue; return; }
+            m.resize((size_t)len + 1);
+
+            struct iovec iov = { &m[0], (size_t)len };
+            struct msghdr mh;
+            std::memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = &iov;
+            mh.msg_iovlen = 1;
+            mh.msg_control = ctl.buf;
+            mh.msg_controllen = sizeof(ctl.buf);
+            ssize_t n;
+            do { n = ::recvmsg(sock, &mh, MSG_CMSG_CLOEXEC); } while (n < 0 && errno == EINTR);
+            if (n <= 0) return;
+
+            int fds[MAX_FDS + 1];
+            size_t nrecv = 0;
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+                if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+                size_t k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < k && nrecv <= MAX_FDS; ++i)
+                    std::memcpy(&fds[nrecv++], CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            }
+
+            reply_ r;
+            r.pid = -1;
+            r.err = handle_(m, (size_t)n, fds, nrecv, argv, envp, tmp, &r.pid);
+            for (size_t i = 0; i < nrecv; ++i) ::close(fds[i]);
+            if (::send(sock, &r, sizeof(r), MSG_NOSIGNAL) < 0) return;
+        }
+    }
+
+    static int handle_(std::vector<char>& m, size_t len, const int* fds, size_t nrecv,
+                       std::vector<char*>& argv, std::vector<char*>& envp, std::vector<int>& tmp, pid_t* pid) {
+        request_ h;
+        if (len < sizeof(h)) return EPROTO;
+        std::memcpy(&h, &m[0], sizeof(h));
+        size_t nsrc = (size_t)h.nfds;
+        if (h.nfds < 0 || nrecv != nsrc + (h.has_exec_fd ? 1 : 0)) return EPROTO;
+        size_t off = sizeof(h);
+        if (len - off < nsrc * sizeof(int)) return EPROTO;
+        std::vector<int> dst(nsrc);
+        if (nsrc) std::memcpy(&dst[0], &m[off], nsrc * sizeof(int));
+        off += nsrc * sizeof(int);
+
+        // Strings: the buffer has one spare byte, so the last one is always terminated
+        m[len] = '\0';
+        unsigned nstr = h.argc + h.envc + (h.has_chdir ? 1 : 0) + (h.has_exec_path ? 1 : 0) + (h.has_path ? 1 : 0);
+        std::vector<char*> strs;
+        for (unsigned i = 0; i < nstr; ++i) {
+            if (off >= len) return EPROTO;
+            strs.push_back(&m[off]);
+            off += std::strlen(&m[off]) + 1;
+        }
+        if (h.argc == 0) return EINVAL;
+        argv.assign(strs.begin(), strs.begin() + h.argc);
+        argv.push_back(0);
+        envp.assign(strs.begin() + h.argc, strs.begin() + h.argc + h.envc);
+        envp.push_back(0);
+        size_t k = h.argc + h.envc;
+        const char* chdir_to  = h.has_chdir     ? strs[k++] : 0;
+        const char* exec_path = h.has_exec_path ? strs[k++] : 0;
+        const char* path      = h.has_path      ? strs[k++] : 0;
+
+        tmp.resize(nsrc + 1);
+        popen3::child_ctx_ c;
+        c.src = nsrc ? fds : 0;
+        c.dst = nsrc ? &dst[0] : 0;
+        c.tmp = &tmp[0];
+        c.nfds = nsrc;
+        c.min_free = 3;
+        for (size_t i = 0; i < nsrc; ++i)
+            if (dst[i] >= c.min_free) c.min_free = dst[i] + 1;
+        c.chdir_to = chdir_to;
+        c.setpgid = (h.setpgid != 0);
+        c.pgid = h.pgid;
+        c.argv = &argv[0];
+        c.envp = &envp[0];
+        c.path = path;
+        c.exec_path = exec_path;
+        c.exec_fd = h.has_exec_fd ? fds[nsrc] : -1;
+        std::vector<char*> sh_argv;
+        popen3::build_sh_argv_(&argv[0], sh_argv);
+        c.sh_argv = &sh_argv[0];
+        c.restore_mask = &h.mask;
+        c.close_others = false; // Only the descriptors sent with the request are open
+        c.keep = 0;
+        c.nkeep = 0;
+
+        int exerr[2];
+        if (::pipe2(exerr, O_CLOEXEC) != 0) return errno;
+        c.exerr_w = exerr[1];
+
+        // fork() semantics, but the child's parent is our owner
+        long p = ::syscall(SYS_clone, (unsigned long)(CLONE_PARENT | SIGCHLD), 0, 0, 0, 0);
+        if (p == 0) popen3::child_exec_(c); // Does not return
+        int e = errno;
+        ::close(exerr[1]);
+        if (p < 0) { ::close(exerr[0]); return e; }
+        *pid = (pid_t)p;
+
+        int child_errno = 0;
+        ssize_t n = popen3::read_full_errno_(exerr[0], &child_errno, sizeof(child_errno));
+        ::close(exerr[0]);
+        return (n > 0) ? child_errno : 0;
+    }
+
+    static void close_fds_except_(int keep) {
+#if defined(SYS_close_range)
+        if ((keep <= 3 || ::syscall(SYS_close_range, 3u, (unsigned)keep - 1, 0u) == 0) &&
+            ::syscall(SYS_close_range, (unsigned)keep + 1, ~0u, 0u) == 0)
+            return;
+#endif
+        long max = ::sysconf(_SC_OPEN_MAX);
+        if (max < 0 || max > 65536) max = 65536;
+        for (int fd = 3; fd < max; ++fd)
+            if (fd != keep) ::close(fd);
+    }
+#endif
+};
+
+inline bool popen3::spawn_via_server_(const options& opt, const exec_plan_& plan, const int* src,
+                                      const int* dst, size_t nfds, pid_t* pid, int* exec_err) {
+    if (!opt.server->running()) { errno = ENOTCONN; return false; }
+    // The helper holds no other descriptors, so its children are hermetic anyway;
+    // inherit_fds travel with the request like the stdio sources
+    std::vector<int> srcs(src, src + nfds), dsts(dst, dst + nfds);
+    for (size_t i = 0; i < opt.inherit_fds.size(); ++i) {
+        srcs.push_back(opt.inherit_fds[i]);
+        dsts.push_back(opt.inherit_fds[i]);
+    }
+    return opt.server->spawn_(plan.argv, plan.envp.empty() ? environ : &plan.envp[0],
+                              opt.chdir_to.empty() ? 0 : opt.chdir_to.c_str(), opt.setpgid, opt.pgid,
+                              plan.exec_path, plan.exec_fd, plan.path,
+                              &srcs[0], &dsts[0], srcs.size(), pid, exec_err);
+}
+
+// a | b | c without a shell: each stage's stdout is a pipe straight into the
+// next stage's stdin, so the data never passes through this process. The first
+// stage's `in` and the last stage's `out` are taken from their options (PIPE
+// exposes them here); every stage keeps its own `err`. Options other than
+// in/out apply per stage.
+class pipeline {
+public:
+    pipeline() : last_errno_(0) {}
+    ~pipeline() {
+        for (size_t i = 0; i < stages_.size(); ++i) delete stages_[i].proc;
+    }
+
+    // Append a stage (before start())
+    void add(const std::vector<std::string>& argv, const popen3::options& opt = popen3::options()) {
+        stage_ s;
+        s.argv = argv;
+        s.opt = opt;
+        s.proc = 0;
+        stages_.push_back(s);
+    }
+
+    // Launch every stage. With process_group, all stages join the first stage's
+    // process group, so kill(-pgid, sig) or a terminal treats them as one job.
+    // On failure the stages already running are killed and reaped.
+    bool start(bool process_group = false) {
+        last_error_msg_.clear(); last_errno_ = 0;
+        if (stages_.empty()) return fail_("pipeline has no stages", EINVAL);
+        int prev_r = -1; // Read end feeding the current stage
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            stage_& s = stages_[i];
+            popen3::options opt = s.opt;
+            int p[2] = { -1, -1 };
+            if (i > 0) opt.in = popen3::stream_spec::use_fd(prev_r);
+            if (i + 1 < stages_.size()) {
+                if (popen3::pipe_cloexec_(p) != 0) {
+                    int e = errno;
+                    if (prev_r != -1) ::close(prev_r);
+                    abort_();
+                    return fail_("pipe", e);
+                }
+                opt.out = popen3::stream_spec::use_fd(p[1]);
+            }
+            if (process_group) {
+                opt.setpgid = true;
+                opt.pgid = (i == 0) ? 0 : stages_[0].proc->pid();
+            }
+            delete s.proc;
+            s.proc = new popen3();
+            bool ok = s.proc->start(s.argv, opt);
+            // The child holds its own copies now
+            if (prev_r != -1) ::close(prev_r);
+            if (p[1] != -1) ::close(p[1]);
+            prev_r = p[0];
+            if (!ok) {
+                char buf[64];
+                std::snprintf(buf, sizeof(buf), "stage %u: ", (unsigned)i);
+                std::string msg = buf + s.proc->last_error();
+                int e = s.proc->last_errno();
+                if (prev_r != -1) ::close(prev_r);
+                abort_();
+                return fail_(msg.c_str(), e);
+            }
+        }
+        return true;
+    }
+
+    size_t size() const { return stages_.size(); }
+    popen3& stage(size_t i) { return *stages_[i].proc; }
+
+    // First stage's stdin / last stage's stdout
+    ssize_t write_stdin(const void* data, size_t len) {
+        popen3* p = first_();
+        if (!p) { errno = EBADF; return -1; }
+        return p->write_stdin(data, len);
+    }
+    ssize_t read_stdout(void* buf, size_t len) {
+        popen3* p = last_();
+        if (!p) { errno = EBADF; return -1; }
+        return p->read_stdout(buf, len);
+    }
+    void close_stdin()  { if (popen3* p = first_()) p->close_stdin(); }
+    void close_stdout() { if (popen3* p = last_()) p->close_stdout(); }
+    int stdin_fd() const  { return first_() ? first_()->stdin_fd() : -1; }
+    int stdout_fd() const { return last_() ? last_()->stdout_fd() : -1; }
+    // stderr of stage i (when that stage's err is PIPE)
+    ssize_t read_stderr(size_t i, void* buf, size_t len) { return stages_[i].proc->read_stderr(buf, len); }
+
+    // Signal every running stage
+    int kill(int sig) {
+        int r = 0;
+        for (size_t i = 0; i < stages_.size(); ++i)
+            if (stages_[i].proc && stages_[i].proc->pid() > 0 && stages_[i].proc->kill(sig) != 0) r = -1;
+        return r;
+    }
+
+    // Wait for every stage; statuses[i] is waitpid-style for stage i (-1 if it
+    // could not be waited for). Returns false if any wait failed.
+    bool wait(std::vector<int>* statuses = 0) {
+        bool ok = true;
+        if (statuses) statuses->assign(stages_.size(), -1);
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            int st = -1;
+            if (!stages_[i].proc || stages_[i].proc->wait(&st, 0) <= 0) { ok = false; continue; }
+            if (statuses) (*statuses)[i] = st;
+        }
+        return ok;
+    }
+
+    const std::string& last_error() const { return last_error_msg_; }
+    int last_errno() const { return last_errno_; }
+
+private:
+    struct stage_ {
+        std::vector<std::string> argv;
+        popen3::options opt;
+        popen3* proc;
+    };
+    std::vector<stage_> stages_;
+    std::string last_error_msg_;
+    int last_errno_;
+
+    pipeline(const pipeline&);
+    pipeline& operator=(const pipeline&);
+
+    popen3* first_() const { return stages_.empty() ? 0 : stages_.front().proc; }
+    popen3* last_() const { return stages_.empty() ? 0 : stages_.back().proc; }
+
+    bool fail_(const char* what, int e) {
+        last_error_msg_ = what;
+        last_errno_ = e;
+        return false;
+    }
+
+    void abort_() {
+        for (size_t i = 0; i < stages_.size(); ++i) {
+            popen3* p = stages_[i].proc;
+            if (!p || p->pid() <= 0) continue;
+            p->kill(SIGKILL);
+            int st;
+            p->wait(&st, 0);
+        }
+    }
+};
+
+// Pool of long-lived children that serve delimiter-framed requests over
+// stdin/stdout (python/jq/custom filters kept warm instead of exec'd per job).
+// call() hands a request to an idle worker and returns its response. Crashed
+// workers are restarted with exponential backoff (one found dead while idle
+// counts as crashed and is never handed a request); a worker is recycled after
+// max_requests requests or once its RSS exceeds max_rss_kb. Thread-safe.
+// A request whose worker dies or times out fails; it is not retried.
+class worker_pool {
+public:
+    struct options {
+        std::vector<std::string> argv;   // Worker command line
+        popen3::options proc;            // Spawn options; in/out are forced to pipes
+        size_t workers;                  // Number of children
+        std::string delimiter;           // Terminates every request and response
+        unsigned max_requests;           // Recycle after this many requests (0: never)
+        size_t max_rss_kb;               // Recycle above this RSS (0: never; Linux)
+        unsigned backoff_initial_ms;     // Restart delay after the first crash...
+        unsigned backoff_max_ms;         // ...doubling up to this
+        int request_timeout_ms;          // -1: none; a timed-out worker is killed
+        options()
+        : workers(1), delimiter("\n"), max_requests(0), max_rss_kb(0),
+          backoff_initial_ms(100), backoff_max_ms(10000), request_timeout_ms(-1) {}
+    };
+
+    explicit worker_pool(const options& opt) : opt_(opt), stopping_(false), restarts_(0) {
+        opt_.proc.in  = popen3::stream_spec::pipe();
+        opt_.proc.out = popen3::stream_spec::pipe();
+        if (opt_.delimiter.empty()) opt_.delimiter = "\n";
+        ::pthread_mutex_init(&mu_, 0);
+        pthread_condattr_t ca;
+        ::pthread_condattr_init(&ca);
+        ::pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+        ::pthread_cond_init(&cv_, &ca);
+        ::pthread_condattr_destroy(&ca);
+        for (size_t i = 0; i < opt_.workers; ++i) workers_.push_back(new worker_());
+    }
+
+    ~worker_pool() {
+        stop();
+        for (size_t i = 0; i < workers_.size(); ++i) delete workers_[i];
+        ::pthread_cond_destroy(&cv_);
+        ::pthread_mutex_destroy(&mu_);
+    }
+
+    // Spawn every worker. Returns false if none could be started. Also
+    // reopens a pool after stop().
+    bool start(std::string* error = 0) {
+        ::pthread_mutex_lock(&mu_);
+        stopping_ = false;
+        ::pthread_mutex_unlock(&mu_);
+        size_t ok = 0;
+        for (size_t i = 0; i < workers_.size(); ++i)
+            if (workers_[i]->proc || launch_(*workers_[i], error)) ++ok;
+        return ok > 0;
+    }
+
+    // Send request (the delimiter is appended) and store the reply without its delimiter.
+    // Blocks until a worker is available.
+    bool call(const std::string& request, std::string& response, std::string* error = 0) {
+        worker_* w = acquire_(error);
+        if (!w) return false;
+        bool ok = dispatch_(*w, request, response, error);
+        if (ok) {
+            ++w->served;
+            if (should_recycle_(*w)) retire_(*w, true);
+        } else {
+            retire_(*w, false);
+            back_off_(*w);
+        }
+        release_(*w);
+        return ok;
+    }
+
+    // Stop every worker (waits for in-flight calls). Later call()s fail with
+    // "worker_pool stopped" until start() is called again.
+    void stop() {
+        ::pthread_mutex_lock(&mu_);
+        stopping_ = true;
+        for (;;) {
+            bool busy = false;
+            for (size_t i = 0; i < workers_.size(); ++i) busy = busy || workers_[i]->busy;
+            if (!busy) break;
+            ::pthread_cond_wait(&cv_, &mu_);
+        }
+        ::pthread_mutex_unlock(&mu_);
+        for (size_t i = 0; i < workers_.size(); ++i) retire_(*workers_[i], true);
+        ::pthread_mutex_lock(&mu_);
+        ::pthread_cond_broadcast(&cv_); // Waiting callers fail now
+        ::pthread_mutex_unlock(&mu_);
+    }
+
+    size_t size() const { return workers_.size(); }
+    // Number of times a worker was (re)started after the initial start()
+    unsigned long restarts() const {
+        ::pthread_mutex_lock(&mu_);
+        unsigned long n = restarts_;
+        ::pthread_mutex_unlock(&mu_);
+        return n;
+    }
+
+private:
+    struct worker_ {
+        popen3* proc;
+        std::string rbuf;        // Bytes read past the last delimiter
+        unsigned served;
+        unsigned backoff_ms;
+        int64_t next_start_ms; // Earliest restart time after a crash
+        bool busy;
+        bool started_once;
+        worker_() : proc(0), served(0), backoff_ms(0), next_start_ms(0), busy(false), started_once(false) {}
+    };
+
+    options opt_;
+    std::vector<worker_*> workers_;
+    mutable pthread_mutex_t mu_;
+    pthread_cond_t cv_;
+    bool stopping_;
+    unsigned long restarts_;
+
+    worker_pool(const worker_pool&);
+    worker_pool& operator=(const worker_pool&);
+
+    static int64_t now_ms_() {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    bool launch_(worker_& w, std::string* error) {
+        popen3* p = new popen3();
+        if (!p->start(opt_.argv, opt_.proc)) {
+            if (error) *error = p->last_error();
+            delete p;
+            return false;
+        }
+        w.proc = p;
+        w.rbuf.clear();
+        w.served = 0;
+        if (w.started_once) {
+            ::pthread_mutex_lock(&mu_);
+            ++restarts_;
+            ::pthread_mutex_unlock(&mu_);
+        }
+        w.started_once = true;
+        return true;
+    }
+
+    // Delay the next start of a worker that crashed or could not start
+    void back_off_(worker_& w) {
+        w.backoff_ms = w.backoff_ms ? std::min(w.backoff_ms * 2, opt_.backoff_max_ms) : opt_.backoff_initial_ms;
+        w.next_start_ms = now_ms_() + w.backoff_ms;
+    }
+
+    // Pick an idle live worker, else a dead one whose backoff has expired
+    worker_* acquire_(std::string* error) {
+        ::pthread_mutex_lock(&mu_);
+        for (;;) {
+            if (stopping_) {
+                ::pthread_mutex_unlock(&mu_);
+                if (error) *error = "worker_pool stopped";
+                return 0;
+            }
+            int64_t now = now_ms_();
+            int64_t next = -1;
+            worker_* pick = 0;
+            for (size_t i = 0; i < workers_.size() && !pick; ++i) {
+                worker_* w = workers_[i];
+                if (!w->busy && w->proc) pick = w;
+            }
+            for (size_t i = 0; i < workers_.size() && !pick; ++i) {
+                worker_* w = workers_[i];
+                if (w->busy || w->proc) continue;
+                if (w->next_start_ms <= now) pick = w;
+                else if (next < 0 || w->next_start_ms < next) next = w->next_start_ms;
+            }
+            if (pick) {
+                pick->busy = true;
+                ::pthread_mutex_unlock(&mu_);
+                // A worker that died while idle counts as a crash and is not
+                // handed this request; the loop picks another one
+                if (pick->proc && !pick->proc->alive()) {
+                    retire_(*pick, false);
+                    back_off_(*pick);
+                } else if (pick->proc) {
+                    pick->backoff_ms = 0; // Outlived its last request
+                    return pick;
+                } else if (launch_(*pick, error)) {
+                    return pick;
+                } else {
+                    back_off_(*pick);
+                }
+                release_(*pick);
+                ::pthread_mutex_lock(&mu_);
+                continue;
+            }
+            if (workers_.empty()) {
+                ::pthread_mutex_unlock(&mu_);
+                if (error) *error = "worker_pool has no workers";
+                return 0;
+            }
+            if (next >= 0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)(next / 1000);
+                ts.tv_nsec = (long)(next % 1000) * 1000000;
+                ::pthread_cond_timedwait(&cv_, &mu_, &ts);
+                continue;
+            }
+            ::pthread_cond_wait(&cv_, &mu_);
+        }
+    }
+
+    void release_(worker_& w) {
+        ::pthread_mutex_lock(&mu_);
+        w.busy = false;
+        ::pthread_cond_broadcast(&cv_);
+        ::pthread_mutex_unlock(&mu_);
+    }
+
+    bool dispatch_(worker_& w, const std::string& request, std::string& response, std::string* error) {
+        std::string frame;
+        frame.reserve(request.size() + opt_.delimiter.size());
+        frame.append(request).append(opt_.delimiter);
+        if (!write_all_(w.proc->stdin_fd(), frame.data(), frame.size())) {
+            if (error) *error = std::string("write to worker: ") + std::strerror(errno);
+            return false;
+        }
+
+        int64_t deadline = (opt_.request_timeout_ms < 0) ? -1 : now_ms_() + opt_.request_timeout_ms;
+        size_t scanned = 0;
+        char buf[64 * 1024];
+        for (;;) {
+            // A delimiter may straddle two reads: rescan its length minus one
+            size_t from = (scanned >= opt_.delimiter.size()) ? scanned - opt_.delimiter.size() + 1 : 0;
+            std::string::size_type pos = w.rbuf.find(opt_.delimiter, from);
+            if (pos != std::string::npos) {
+                response.assign(w.rbuf, 0, pos);
+                w.rbuf.erase(0, pos + opt_.delimiter.size());
+                return true;
+            }
+            scanned = w.rbuf.size();
+
+            int timeout = -1;
+            if (deadline >= 0) {
+                int64_t left = deadline - now_ms_();
+                if (left <= 0) { if (error) *error = "worker timed out"; return false; }
+                timeout = (int)left;
+            }
+            struct pollfd pfd;
+            pfd.fd = w.proc->stdout_fd();
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int r = ::poll(&pfd, 1, timeout);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) { if (error) *error = std::string("poll: ") + std::strerror(errno); return false; }
+            if (r == 0) continue; // Deadline re-checked above
+            ssize_t n = w.proc->read_stdout(buf, sizeof(buf));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (n <= 0) { if (error) *error = "worker exited"; return false; }
+            w.rbuf.append(buf, (size_t)n);
+        }
+    }
+
+    // Blocking write that reports EPIPE instead of raising SIGPIPE in the caller
+    static bool write_all_(int fd, const char* p, size_t len) {
+        popen3::sigpipe_guard_ guard;
+        return popen3::write_full_(fd, p, len);
+    }
+
+    bool should_recycle_(const worker_& w) const {
+        if (opt_.max_requests && w.served >= opt_.max_requests) return true;
+        if (opt_.max_rss_kb && rss_kb_(w.proc->pid()) > opt_.max_rss_kb) return true;
+        return false;
+    }
+
+    static size_t rss_kb_(pid_t pid) {
+#if defined(__linux__)
+        char path[64];
+        std::snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+        FILE* f = std::fopen(path, "r");
+        if (!f) return 0;
+        unsigned long size = 0, resident = 0;
+        int n = std::fscanf(f, "%lu %lu", &size, &resident);
+        std::fclose(f);
+        if (n != 2) return 0;
+        return (size_t)(resident * (unsigned long)::sysconf(_SC_PAGESIZE) / 1024);
+#else
+        (void)pid;
+        return 0;
+#endif
+    }
+
+    // Graceful: close stdin so the worker can exit on its own, kill it if it
+    // lingers for a second. Otherwise (crash/timeout) kill it right away.
+    static void retire_(worker_& w, bool graceful) {
+        popen3* p = w.proc;
+        if (!p) return;
+        w.proc = 0;
+        p->close_stdin();
+        for (int i = 0; graceful && i < 100 && p->alive(); ++i) {
+            if (p->process_fd() != -1) {
+                struct pollfd pfd = { p->process_fd(), POLLIN, 0 };
+                ::poll(&pfd, 1, 1000);
+                break;
+            }
+            ::usleep(10 * 1000);
+        }
+        if (p->alive()) p->kill(SIGKILL);
+        int st;
+        p->wait(&st, 0);
+        delete p;
+    }
+};
+
+#if defined(__linux__)
+// Callbacks of reactor-managed children. They run on the reactor's thread;
+// the popen3 is owned by the reactor and deleted after on_exit returns.
+class reactor_handler {
+public:
+    virtual ~reactor_handler() {}
+    virtual void on_stdout(popen3& proc, const char* data, size_t len) { (void)proc; (void)data; (void)len; }
+    virtual void on_stderr(popen3& proc, const char* data, size_t len) { (void)proc; (void)data; (void)len; }
+    // After stdout/stderr reached EOF and the child was reaped; status is waitpid-style
+    virtual void on_exit(popen3& proc, int status) { (void)proc; (void)status; }
+};
+
+// io_uring ABI (linux/io_uring.h), declared here so that neither liburing nor
+// recent kernel headers are needed to build the io_uring reactor backend.
+namespace uring_abi_ {
+    struct sqe {
+        uint8_t  opcode;
+        uint8_t  flags;
+        uint16_t ioprio;
+        int32_t  fd;
+        uint64_t off;
+        uint64_t addr;
+        uint32_t len;
+        uint32_t op_flags;   // rw_flags / poll32_events
+        uint64_t user_data;
+        uint16_t buf_group;
+        uint16_t personality;
+        int32_t  splice_fd_in;
+        uint64_t pad[2];
+    };
+    struct cqe {
+        uint64_t user_data;
+        int32_t  res;
+        uint32_t flags;
+    };
+    struct sqring_offsets { uint32_t head, tail, ring_mask, ring_entries, flags, dropped, array, resv1; uint64_t user_addr; };
+    struct cqring_offsets { uint32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags, resv1; uint64_t user_addr; };
+    struct params {
+        uint32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle, features, wq_fd, resv[3];
+        sqring_offsets sq_off;
+        cqring_offsets cq_off;
+    };
+    struct buf { uint64_t addr; uint32_t len; uint16_t bid; uint16_t resv; }; // resv of buf[0] is the ring tail
+    struct buf_reg { uint64_t ring_addr; uint32_t ring_entries; uint16_t bgid; uint16_t flags; uint64_t resv[3]; };
+    struct getevents_arg { uint64_t sigmask; uint32_t sigmask_sz; uint32_t pad; uint64_t ts; };
+
+    enum {
+        OP_POLL_ADD = 6, OP_ASYNC_CANCEL = 14, OP_READ = 22, OP_WRITE = 23,
+        SQE_BUFFER_SELECT = 1U << 5,
+        CQE_F_BUFFER = 1U << 0, CQE_BUFFER_SHIFT = 16,
+        SETUP_CQSIZE = 1U << 3, SETUP_CLAMP = 1U << 4, SETUP_COOP_TASKRUN = 1U << 8,
+        FEAT_SINGLE_MMAP = 1U << 0, FEAT_NODROP = 1U << 1, FEAT_EXT_ARG = 1U << 8,
+        ENTER_GETEVENTS = 1U << 0, ENTER_EXT_ARG = 1U << 3,
+        REGISTER_PBUF_RING = 22
+    };
+    static const off_t OFF_SQ_RING = 0;
+    static const off_t OFF_SQES = 0x10000000;
+
+#if defined(__NR_io_uring_setup)
+    enum { NR_setup = __NR_io_uring_setup, NR_enter = __NR_io_uring_enter, NR_register = __NR_io_uring_register };
+#else
+    enum { NR_setup = 425, NR_enter = 426, NR_register = 427 }; // Same number on every architecture
+#endif
+} // namespace uring_abi_
+
+// Single-threaded event loop over many children (Linux). With BACKEND_EPOLL
+// pipes are read edge-triggered and exits arrive through each child's pidfd,
+// so a wakeup costs O(ready descriptors) no matter how many children are
+// alive; a busy child is read at most `burst` chunks per turn and then
+// requeued, so it cannot starve the others. BACKEND_IO_URING instead keeps a
+// read posted on every pipe and a poll on every pidfd (and on stdin while
+// queued input waits for room), resubmitting them in one io_uring_enter per
+// turn. Reads pick their memory from a provided buffer ring when data
+// arrives, so idle children hold no buffers. It needs Linux 5.19+ and falls
+// back to epoll otherwise (see backend()).
+// Output limits (options.out_limit / err_limit) hold under both backends: a
+// stream over its rate waits on a timer rather than stalling the loop, and one
+// past a BACKPRESSURE max_bytes is left open but no longer read.
+// add()/spawn()/stop() may be called from any thread; write_stdin() and
+// close_stdin() only from the loop thread or while run() is not active.
+class reactor {
+public:
+    enum backend_t { BACKEND_EPOLL, BACKEND_IO_URING };
+
+    explicit reactor(size_t burst = 16, backend_t backend = BACKEND_EPOLL)
+    : epfd_(-1), wakefd_(-1), burst_(burst ? burst : 1), backend_(BACKEND_EPOLL),
+      stopping_(false), last_errno_(0) {
+        ::pthread_mutex_init(&mu_, 0);
+        wake_tok_.e = 0; wake_tok_.kind = 4; wake_tok_.queued = false; wake_tok_.hup = false; wake_tok_.throttled = false;
+        cancel_tok_.e = 0; cancel_tok_.kind = 5; cancel_tok_.queued = false; cancel_tok_.hup = false; cancel_tok_.throttled = false;
+        wakefd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wakefd_ == -1) { fail_("eventfd", errno); return; }
+        if (backend == BACKEND_IO_URING && ring_.open(256, 512, 32 * 1024)) {
+            backend_ = BACKEND_IO_URING;
+            arm_wake_();
+            return;
+        }
+        buf_.resize(64 * 1024);
+        epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epfd_ == -1) { fail_("epoll_create1", errno); return; }
+        struct epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_tok_;
+        if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev) != 0) fail_("epoll_ctl(eventfd)", errno);
+    }
+
+    // Children still managed are killed (SIGKILL) and reaped without callbacks
+    ~reactor() {
+        for (size_t i = 0; i < entries_.size(); ++i)
+            if (entries_[i]->proc->pid() > 0) entries_[i]->proc->kill(SIGKILL);
+        if (backend_ == BACKEND_IO_URING) cancel_inflight_();
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            popen3* p = entries_[i]->proc;
+            if (p->pid() > 0) { int st; p->wait(&st, 0); }
+            delete p;
+            delete entries_[i];
+        }
+        ring_.close();
+        if (epfd_ != -1) ::close(epfd_);
+        if (wakefd_ != -1) ::close(wakefd_);
+        ::pthread_mutex_destroy(&mu_);
+    }
+
+    bool ok() const { return wakefd_ != -1 && (epfd_ != -1 || ring_.fd != -1); }
+    backend_t backend() const { return backend_; }
+
+    // Take over a started child (allocated with new). Its stdout and stderr are
+    // switched to non-blocking (epoll) or blocking (io_uring) mode, except that
+    // io_uring also reads an output stream with a limit or tee sinks through
+    // popen3 and makes it non-blocking; stdin stays as it is until the first
+    // write_stdin() through the reactor makes it non-blocking. The loop thread watches it from its next turn on; if it
+    // cannot, the child is killed and reported through on_exit (see
+    // last_error()). On failure the caller keeps ownership. Once the loop runs
+    // on another thread, proc may be deleted at any time: use it only from the
+    // callbacks.
+    bool add(popen3* proc, reactor_handler* h) {
+        if (!proc || proc->pid() <= 0) return fail_("add: child not started", ECHILD);
+        entry_* e = new entry_();
+        e->proc = proc;
+        e->h = h;
+        e->exited = (proc->process_fd() == -1); // Without a pidfd, EOF stands for the exit
+        for (int k = 0; k < 4; ++k) {
+            token_& t = e->tok[k];
+            t.e = e; t.kind = k; t.queued = false; t.hup = false; t.throttled = false; t.resume_ms = 0;
+        }
+        int fds[4] = { proc->stdout_fd(), proc->stderr_fd(), proc->process_fd(), proc->stdin_fd() };
+        // io_uring polls blocking pipes itself; edge-triggered epoll needs non-blocking
+        // ones, and so do the streams io_uring only polls
+        for (int k = 0; k < 4; ++k) {
+            if (fds[k] == -1) continue;
+            if (k < 2) {
+                e->polled[k] = (backend_ == BACKEND_IO_URING && reads_via_proc_(*proc, k));
+                popen3::set_nonblock_(fds[k], backend_ == BACKEND_EPOLL || e->polled[k]);
+            }
+            e->open[k] = true;
+        }
+        // The loop registers (or posts) the descriptors, so no other thread ever
+        // frees an entry whose tokens the loop may hold
+        ::pthread_mutex_lock(&mu_);
+        e->index = entries_.size();
+        entries_.push_back(e);
+        by_proc_[proc] = e;
+        incoming_.push_back(e);
+        ::pthread_mutex_unlock(&mu_);
+        wake_();
+        return true;
+    }
+
+    // Start a child and add() it. Returns false on failure (see last_error()).
+    // The child is reached through the handler's callbacks.
+    bool spawn(const std::vector<std::string>& argv, const popen3::options& opt, reactor_handler* h) {
+        popen3* p = new popen3();
+        if (!p->start(argv, opt)) {
+            fail_(p->last_error().c_str(), p->last_errno());
+            delete p;
+            return false;
+        }
+        if (!add(p, h)) {
+            p->kill(SIGKILL);
+            int st;
+            p->wait(&st, 0);
+            delete p;
+            return false;
+        }
+        return true;
+    }
+
+    // Queue data for the child's stdin; it is written as the child reads, so
+    // the loop never blocks on a full pipe. Data queued after EPIPE is dropped.
+    // The first call makes stdin non-blocking, so only use the reactor to write
+    // it from then on.
+    bool write_stdin(popen3& proc, const char* data, size_t len) {
+        entry_* e = find_(&proc);
+        if (!e) return fail_("write_stdin: not managed by this reactor", ESRCH);
+        if (!e->open[3] || e->close_stdin) return fail_("write_stdin", EPIPE);
+        if (!e->stdin_armed && !arm_stdin_(e)) return false;
+        e->wq.append(data, len);
+        if (!e->write_posted) flush_stdin_(e);
+        return true;
+    }
+
+    // Close the child's stdin once the queued data has been written
+    bool close_stdin(popen3& proc) {
+        entry_* e = find_(&proc);
+        if (!e) return fail_("close_stdin: not managed by this reactor", ESRCH);
+        e->close_stdin = true;
+        if (e->open[3] && !e->write_posted && e->woff == e->wbuf.size() && e->wq.empty()) close_stream_(e, 3);
+        return true;
+    }
+
+    // Wait up to timeout_ms (-1: forever) and dispatch. Returns the number of
+    // events handled, or -1 on error.
+    int run_once(int timeout_ms = -1) {
+        if (backend_ == BACKEND_IO_URING) return run_uring_(timeout_ms);
+        register_incoming_();
+        wake_throttled_();
+        timeout_ms = turn_timeout_(timeout_ms, !ready_.empty());
+        struct epoll_event evs[256];
+        int n = ::epoll_wait(epfd_, evs, 256, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) return 0;
+            fail_("epoll_wait", errno);
+            return -1;
+        }
+        // Requeued busy streams first, then the new events
+        std::vector<token_*> work;
+        work.swap(ready_);
+        for (int i = 0; i < n; ++i) {
+            token_* t = static_cast<token_*>(evs[i].data.ptr);
+            if (t == &wake_tok_) { drain_wake_(); continue; }
+            if (evs[i].events & (EPOLLHUP | EPOLLRDHUP)) t->hup = true;
+            if (!t->queued) { t->queued = true; work.push_back(t); }
+        }
+        int handled = 0;
+        for (size_t i = 0; i < work.size(); ++i) {
+            token_* t = work[i];
+            t->queued = false;
+            entry_* e = t->e;
+            if (t->kind == 2) on_pidfd_(e);
+            else if (t->kind == 3) flush_stdin_(e);
+            else pump_(t);
+            ++handled;
+            finish_if_done_(e);
+        }
+        collect_done_pending_();
+        return handled;
+    }
+
+    // Loop until every child has been reported, or until stop() with until_stopped
+    void run(bool until_stopped = false) {
+        for (;;) {
+            if (stop_requested_()) break;
+            if (!until_stopped && size() == 0) break;
+            if (run_once(-1) < 0) break;
+        }
+        ::pthread_mutex_lock(&mu_);
+        stopping_ = false;
+        ::pthread_mutex_unlock(&mu_);
+    }
+
+    // Make run() return after the current turn (thread-safe)
+    void stop() {
+        ::pthread_mutex_lock(&mu_);
+        stopping_ = true;
+        ::pthread_mutex_unlock(&mu_);
+        wake_();
+    }
+
+    size_t size() const {
+        ::pthread_mutex_lock(&mu_);
+        size_t n = entries_.size();
+        ::pthread_mutex_unlock(&mu_);
+        return n;
+    }
+
+    std::string last_error() const {
+        ::pthread_mutex_lock(&mu_);
+        std::string m = last_error_msg_;
+        ::pthread_mutex_unlock(&mu_);
+        return m;
+    }
+    int last_errno() const {
+        ::pthread_mutex_lock(&mu_);
+        int e = last_errno_;
+        ::pthread_mutex_unlock(&mu_);
+        return e;
+    }
+
+private:
+    struct entry_;
+    struct token_ {
+        entry_* e;
+        int kind;     // 0: stdout, 1: stderr, 2: pidfd, 3: stdin, 4: wake-up, 5: cancel
+        bool queued;  // epoll: in this turn's work list or in ready_
+        bool hup;     // epoll: the writer is gone, so no further edge will come
+        bool throttled;      // In throttled_, waiting for an output_limit rate budget
+        long long resume_ms; // When to read it again (monotonic)
+    };
+    struct entry_ {
+        popen3* proc;
+        reactor_handler* h;
+        token_ tok[4];
+        bool open[4];       // Still watched
+        bool exited;        // pidfd fired (or there is no pidfd)
+        bool done_pending;  // To be finished on the next turn
+        size_t index;       // Position in entries_
+        int posted;         // io_uring operations in flight
+        std::string wbuf;   // stdin data being written
+        size_t woff;
+        std::string wq;     // stdin data queued behind wbuf
+        bool write_posted;  // io_uring: a POLLOUT poll on stdin is in flight
+        bool close_stdin;   // Close stdin once wbuf/wq are written
+        bool cancel_sent;
+        bool stdin_armed;   // stdin made non-blocking (and registered with epoll)
+        bool polled[2];     // io_uring: stdout/stderr polled, then read through popen3
+        bool paused[2];     // BACKPRESSURE max_bytes reached: left open, no longer read
+        entry_() : proc(0), h(0), exited(false), done_pending(false), index(0), posted(0), woff(0),
+                   write_posted(false), close_stdin(false), cancel_sent(false), stdin_armed(false) {
+            open[0] = open[1] = open[2] = open[3] = false;
+            polled[0] = polled[1] = false;
+            paused[0] = paused[1] = false;
+        }
+    };
+
+    // Raw io_uring: submission/completion rings plus one provided buffer ring
+    class uring_ {
+    public:
+        int fd;
+        unsigned bufsize;
+
+        uring_() : fd(-1), bufsize(0), ring_(MAP_FAILED), ring_size_(0), sqes_(0), sqes_size_(0),
+                   sq_head_(0), sq_tail_(0), sq_mask_(0), sq_array_(0), sq_entries_(0), sq_local_(0),
+                   cq_head_(0), cq_tail_(0), cq_mask_(0), cqes_(0),
+                   br_(0), br_size_(0), pool_(0), pool_size_(0), nbufs_(0), br_tail_(0) {}
+        ~uring_() { close(); }
+
+        bool open(unsigned entries, unsigned nbufs, unsigned size) {
+            using namespace uring_abi_;
+            params p;
+            std::memset(&p, 0, sizeof(p));
+            p.flags = SETUP_CQSIZE | SETUP_CLAMP | SETUP_COOP_TASKRUN;
+            p.cq_entries = entries * 16;
+            fd = (int)::syscall(NR_setup, entries, &p);
+            if (fd == -1 && errno == EINVAL) { // COOP_TASKRUN is 5.19+
+                std::memset(&p, 0, sizeof(p));
+                p.flags = SETUP_CQSIZE | SETUP_CLAMP;
+                p.cq_entries = entries * 16;
+                fd = (int)::syscall(NR_setup, entries, &p);
+            }
+            if (fd == -1) return false;
+            const unsigned need = FEAT_SINGLE_MMAP | FEAT_NODROP | FEAT_EXT_ARG;
+            if ((p.features & need) != need) { close(); return false; }
+
+            size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+            size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(cqe);
+            ring_size_ = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+            ring_ = ::mmap(0, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, OFF_SQ_RING);
+            if (ring_ == MAP_FAILED) { close(); return false; }
+            sqes_size_ = p.sq_entries * sizeof(sqe);
+            void* s = ::mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, OFF_SQES);
+            if (s == MAP_FAILED) { close(); return false; }
+            sqes_ = static_cast<sqe*>(s);
+            char* r = static_cast<char*>(ring_);
+            sq_head_  = reinterpret_cast<unsigned*>(r + p.sq_off.head);
+            sq_tail_  = reinterpret_cast<unsigned*>(r + p.sq_off.tail);
+            sq_mask_  = *reinterpret_cast<unsigned*>(r + p.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned*>(r + p.sq_off.array);
+            sq_entries_ = p.sq_entries;
+            sq_local_ = *sq_tail_;
+            cq_head_  = reinterpret_cast<unsigned*>(r + p.cq_off.head);
+            cq_tail_  = reinterpret_cast<unsigned*>(r + p.cq_off.tail);
+            cq_mask_  = *reinterpret_cast<unsigned*>(r + p.cq_off.ring_mask);
+            cqes_     = reinterpret_cast<cqe*>(r + p.cq_off.cqes);
+
+            // Buffer group 0; nbufs must be a power of two
+            nbufs_ = nbufs;
+            bufsize = size;
+            long page = ::sysconf(_SC_PAGESIZE);
+            br_size_ = (nbufs * sizeof(buf) + page - 1) / page * page;
+            pool_size_ = (size_t)nbufs * size;
+            void* b = ::mmap(0, br_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            void* q = ::mmap(0, pool_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (b == MAP_FAILED || q == MAP_FAILED) {
+                if (b != MAP_FAILED) ::munmap(b, br_size_);
+                if (q != MAP_FAILED) ::munmap(q, pool_size_);
+                close();
+                return false;
+            }
+            br_ = static_cast<buf*>(b);
+            pool_ = static_cast<char*>(q);
+            buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t)(uintptr_t)br_;
+            reg.ring_entries = nbufs;
+            if (::syscall(NR_register, fd, (unsigned)REGISTER_PBUF_RING, &reg, 1) != 0) { close(); return false; }
+            for (unsigned i = 0; i < nbufs; ++i) put_buffer_(i);
+            publish_buffers_();
+            return true;
+        }
+
+        void close() {
+            if (fd != -1) { ::close(fd); fd = -1; }
+            if (ring_ != MAP_FAILED) { ::munmap(ring_, ring_size_); ring_ = MAP_FAILED; }
+            if (sqes_) { ::munmap(sqes_, sqes_size_); sqes_ = 0; }
+            if (br_) { ::munmap(br_, br_size_); br_ = 0; }
+            if (pool_) { ::munmap(pool_, pool_size_); pool_ = 0; }
+        }
+
+        // Next free SQE (zeroed), submitting queued ones first if the ring is full
+        uring_abi_::sqe* get_sqe() {
+            if (sq_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+                if (enter(0, 0) < 0) return 0;
+                if (sq_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) return 0;
+            }
+            unsigned idx = sq_local_ & sq_mask_;
+            sq_array_[idx] = idx;
+            ++sq_local_;
+            std::memset(&sqes_[idx], 0, sizeof(uring_abi_::sqe));
+            return &sqes_[idx];
+        }
+
+        // Submit everything queued and wait for up to min_complete completions
+        // (bounded by timeout_ms unless it is -1). Returns 0 or -1 with errno.
+        int enter(unsigned min_complete, int timeout_ms) {
+            using namespace uring_abi_;
+            __atomic_store_n(sq_tail_, sq_local_, __ATOMIC_RELEASE);
+            unsigned submit = sq_local_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            unsigned flags = ENTER_GETEVENTS;
+            getevents_arg arg;
+            struct timespec ts;
+            void* argp = 0;
+            size_t argsz = 0;
+            if (min_complete && timeout_ms >= 0) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+                std::memset(&arg, 0, sizeof(arg));
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+                flags |= ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+            }
+            if (::syscall(NR_enter, fd, submit, min_complete, flags, argp, argsz) < 0) {
+                if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) return 0;
+                return -1;
+            }
+            return 0;
+        }
+
+        // Completions between head and tail; call cq_advance() when done
+        unsigned cq_ready(unsigned* head) const {
+            *head = *cq_head_;
+            return __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *head;
+        }
+        const uring_abi_::cqe& cq_at(unsigned i) const { return cqes_[i & cq_mask_]; }
+        void cq_advance(unsigned head) { __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE); }
+
+        char* buffer(unsigned bid) const { return pool_ + (size_t)bid * bufsize; }
+
+        void recycle(unsigned bid) { put_buffer_(bid); publish_buffers_(); }
+
+    private:
+        void* ring_;
+        size_t ring_size_;
+        uring_abi_::sqe* sqes_;
+        size_t sqes_size_;
+        unsigned *sq_head_, *sq_tail_;
+        unsigned sq_mask_;
+        unsigned* sq_array_;
+        unsigned sq_entries_, sq_local_;
+        unsigned *cq_head_, *cq_tail_;
+        unsigned cq_mask_;
+        uring_abi_::cqe* cqes_;
+        uring_abi_::buf* br_;
+        size_t br_size_;
+        char* pool_;
+        size_t pool_size_;
+        unsigned nbufs_;
+        uint16_t br_tail_;
+
+        uring_(const uring_&);
+        uring_& operator=(const uring_&);
+
+        void put_buffer_(unsigned bid) {
+            uring_abi_::buf& b = br_[br_tail_ & (nbufs_ - 1)];
+            b.addr = (uint64_t)(uintptr_t)buffer(bid);
+            b.len = bufsize;
+            b.bid = (uint16_t)bid;
+            ++br_tail_;
+        }
+        void publish_buffers_() {
+            uint16_t* tail = reinterpret_cast<uint16_t*>(reinterpret_cast<char*>(br_) + 14);
+            __atomic_store_n(tail, br_tail_, __ATOMIC_RELEASE);
+        }
+    };
+
+    int epfd_, wakefd_;
+    size_t burst_;
+    backend_t backend_;
+    uring_ ring_;
+    token_ wake_tok_, cancel_tok_;
+    std::vector<char> buf_;
+    std::vector<token_*> ready_;     // epoll: streams that still had data after a burst
+    std::vector<token_*> repost_;    // io_uring: reads to post again next turn
+    std::vector<token_*> throttled_; // Streams waiting for their output_limit rate budget
+    std::vector<entry_*> entries_;
+    std::map<const popen3*, entry_*> by_proc_;
+    std::vector<entry_*> incoming_;  // Added but not yet registered/posted by the loop
+    std::vector<entry_*> done_;      // Finished children awaiting on_exit
+    std::vector<entry_*> lingering_; // Past EOF without a pidfd but not exited yet (loop thread only)
+    mutable pthread_mutex_t mu_;
+    bool stopping_;
+    std::string last_error_msg_;
+    int last_errno_;
+
+    reactor(const reactor&);
+    reactor& operator=(const reactor&);
+
+    // Called from any thread, never with mu_ held
+    bool fail_(const char* what, int e) {
+        char buf[256];
+        std::snprintf(buf, sizeof(buf), "%s: %s", what, std::strerror(e));
+        ::pthread_mutex_lock(&mu_);
+        last_error_msg_ = buf;
+        last_errno_ = e;
+        ::pthread_mutex_unlock(&mu_);
+        return false;
+    }
+
+    // Do not block while there is work left over, and poll for the exit of
+    // lingering_ children, which no descriptor announces
+    int turn_timeout_(int timeout_ms, bool more) const {
+        if (more || has_done_pending_()) return 0;
+        if (!lingering_.empty() && (timeout_ms < 0 || timeout_ms > 10)) timeout_ms = 10;
+        if (!throttled_.empty()) {
+            long long next = throttled_[0]->resume_ms;
+            for (size_t i = 1; i < throttled_.size(); ++i) next = std::min(next, throttled_[i]->resume_ms);
+            long long ms = std::max(0LL, next - now_ms_());
+            if (timeout_ms < 0 || ms < timeout_ms) timeout_ms = (int)ms;
+        }
+        return timeout_ms;
+    }
+
+    static long long now_ms_() {
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Throttled streams whose rate budget is back are read again this turn
+    void wake_throttled_() {
+        if (throttled_.empty()) return;
+        long long now = now_ms_();
+        size_t keep = 0;
+        for (size_t i = 0; i < throttled_.size(); ++i) {
+            token_* t = throttled_[i];
+            if (t->resume_ms > now) { throttled_[keep++] = t; continue; }
+            t->throttled = false;
+            if (backend_ == BACKEND_IO_URING) repost_.push_back(t);
+            else if (!t->queued) { t->queued = true; ready_.push_back(t); }
+        }
+        throttled_.resize(keep);
+    }
+
+    // A read under an output_limit was refused (err: its errno). Past a
+    // BACKPRESSURE max_bytes (ENOBUFS) the stream is paused: the pipe stays
+    // open and unread, so the child blocks in write() rather than getting
+    // EPIPE. Over max_rate (EAGAIN with a wait) it is read again once the
+    // budget is back, instead of sleeping here while other children wait.
+    // Returns false when the pipe is merely drained.
+    bool hold_stream_(token_* t, int err) {
+        entry_* e = t->e;
+        if (err == ENOBUFS) {
+            if (!e->paused[t->kind] && epfd_ != -1) {
+                int fd = (t->kind == 0) ? e->proc->stdout_fd() : e->proc->stderr_fd();
+                ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, 0);
+            }
+            e->paused[t->kind] = true;
+            return true;
+        }
+        int ms = (t->kind == 0) ? e->proc->stdout_limit_wait_ms() : e->proc->stderr_limit_wait_ms();
+        if (ms <= 0) return false;
+        if (!t->throttled) {
+            t->throttled = true;
+            t->resume_ms = now_ms_() + ms;
+            throttled_.push_back(t);
+        }
+        return true;
+    }
+
+    // epoll: watch the children add() queued
+    void register_incoming_() {
+        std::vector<entry_*> in;
+        ::pthread_mutex_lock(&mu_);
+        in.swap(incoming_);
+        ::pthread_mutex_unlock(&mu_);
+        for (size_t i = 0; i < in.size(); ++i) {
+            entry_* e = in[i];
+            int fds[3] = { e->proc->stdout_fd(), e->proc->stderr_fd(), e->proc->process_fd() };
+            for (int k = 0; k < 3; ++k) {
+                if (!e->open[k]) continue;
+                struct epoll_event ev;
+                std::memset(&ev, 0, sizeof(ev));
+                ev.events = (k == 2) ? EPOLLIN : (EPOLLIN | EPOLLRDHUP | EPOLLET);
+                ev.data.ptr = &e->tok[k];
+                if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, fds[k], &ev) != 0) { abandon_(e, errno); break; }
+            }
+            finish_if_done_(e); // No output pipes and no pidfd, or abandoned
+        }
+    }
+
+    // First reactor write to stdin: switch it to non-blocking and, with epoll,
+    // watch it for EPOLLOUT
+    bool arm_stdin_(entry_* e) {
+        int fd = e->proc->stdin_fd();
+        popen3::set_nonblock_(fd, true);
+        if (backend_ == BACKEND_EPOLL) {
+            struct epoll_event ev;
+            std::memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT | EPOLLET;
+            ev.data.ptr = &e->tok[3];
+            if (::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) != 0) return fail_("epoll_ctl(stdin)", errno);
+        }
+        e->stdin_armed = true;
+        return true;
+    }
+
+    // The loop cannot watch e: kill the child and report it like any other exit
+    void abandon_(entry_* e, int err) {
+        fail_("epoll_ctl", err);
+        e->proc->kill(SIGKILL);
+        for (int k = 0; k < 4; ++k) close_stream_(e, k);
+        e->exited = true;
+    }
+
+    void wake_() {
+        uint64_t one = 1;
+        ssize_t r = ::write(wakefd_, &one, sizeof(one));
+        (void)r;
+    }
+
+    bool stop_requested_() const {
+        ::pthread_mutex_lock(&mu_);
+        bool s = stopping_;
+        ::pthread_mutex_unlock(&mu_);
+        return s;
+    }
+
+    entry_* find_(const popen3* p) const {
+        ::pthread_mutex_lock(&mu_);
+        std::map<const popen3*, entry_*>::const_iterator it = by_proc_.find(p);
+        entry_* e = (it == by_proc_.end()) ? 0 : it->second;
+        ::pthread_mutex_unlock(&mu_);
+        return e;
+    }
+
+    // epoll: read up to burst_ chunks; requeue if the pipe may still hold data
+    void pump_(token_* t) {
+        entry_* e = t->e;
+        if (!e->open[t->kind] || e->paused[t->kind]) return;
+        // A limit or tee cuts reads short with data left behind, so read those to EAGAIN
+        bool short_is_drained = !reads_via_proc_(*e->proc, t->kind);
+        for (size_t i = 0; i < burst_; ++i) {
+            ssize_t n = (t->kind == 0) ? e->proc->read_stdout(&buf_[0], buf_.size())
+                                       : e->proc->read_stderr(&buf_[0], buf_.size());
+            if (n > 0) {
+                deliver_(e, t->kind, &buf_[0], (size_t)n);
+                if ((size_t)n < buf_.size() && !t->hup && short_is_drained) return; // The next edge brings more
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+                hold_stream_(t, errno);
+                return;
+            }
+            close_stream_(e, t->kind); // EOF or error
+            return;
+        }
+        if (!t->queued) { t->queued = true; ready_.push_back(t); }
+    }
+
+    void deliver_(entry_* e, int kind, const char* p, size_t n) {
+        if (!e->h) return;
+        if (kind == 0) e->h->on_stdout(*e->proc, p, n);
+        else           e->h->on_stderr(*e->proc, p, n);
+    }
+
+    // Write queued stdin data until the pipe is full, then wait for room:
+    // EPOLLOUT, or a POLLOUT poll on the ring. io_uring does not write stdin
+    // itself, since a write it finishes later would raise SIGPIPE in this
+    // thread wherever it happens to be rather than under this guard.
+    void flush_stdin_(entry_* e) {
+        if (!e->open[3]) return;
+        popen3::sigpipe_guard_ guard;
+        for (;;) {
+            if (e->woff == e->wbuf.size()) {
+                e->wbuf.clear();
+                e->woff = 0;
+                if (e->wq.empty()) break;
+                e->wbuf.swap(e->wq);
+            }
+            ssize_t n = ::write(e->proc->stdin_fd(), e->wbuf.data() + e->woff, e->wbuf.size() - e->woff);
+            if (n > 0) { e->woff += (size_t)n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (backend_ == BACKEND_IO_URING) post_stdin_poll_(e);
+                return;
+            }
+            drop_stdin_(e);
+            return;
+        }
+        if (e->close_stdin) close_stream_(e, 3);
+    }
+
+    void drop_stdin_(entry_* e) {
+        e->wbuf.clear();
+        e->wq.clear();
+        e->woff = 0;
+        close_stream_(e, 3);
+    }
+
+    void close_stream_(entry_* e, int kind) {
+        int fd = (kind == 0) ? e->proc->stdout_fd() : (kind == 1) ? e->proc->stderr_fd()
+               : (kind == 2) ? e->proc->process_fd() : e->proc->stdin_fd();
+        if (!e->open[kind]) return;
+        if (fd != -1 && epfd_ != -1) ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, 0);
+        e->open[kind] = false;
+        if (kind == 0) e->proc->close_stdout();
+        if (kind == 1) e->proc->close_stderr();
+        if (kind == 3) e->proc->close_stdin();
+    }
+
+    void on_pidfd_(entry_* e) {
+        if (!e->open[2]) return;
+        close_stream_(e, 2);
+        e->exited = true;
+        if (backend_ == BACKEND_IO_URING) return;
+        // Output written just before the exit may not have raised an edge yet
+        for (int k = 0; k < 2; ++k) if (e->open[k] && !e->tok[k].queued) { e->tok[k].queued = true; ready_.push_back(&e->tok[k]); }
+    }
+
+    void finish_if_done_(entry_* e) {
+        if (e->done_pending || !e->exited) return;
+        if ((e->open[0] && !e->paused[0]) || (e->open[1] && !e->paused[1])) return; // A paused stream holds nothing
+        if (e->tok[0].queued || e->tok[1].queued || e->tok[2].queued || e->tok[3].queued) return;
+        if (e->tok[0].throttled || e->tok[1].throttled) return;
+        if (e->posted > 0) {
+            // Only a stdin write can still be pending (e.g. a grandchild holds the pipe)
+            if (e->write_posted && !e->cancel_sent) post_cancel_(e);
+            return;
+        }
+        ::pthread_mutex_lock(&mu_);
+        e->done_pending = true;
+        done_.push_back(e);
+        ::pthread_mutex_unlock(&mu_);
+    }
+
+    bool has_done_pending_() const {
+        ::pthread_mutex_lock(&mu_);
+        bool any = !done_.empty();
+        ::pthread_mutex_unlock(&mu_);
+        return any;
+    }
+
+    // Reap, report and drop finished children (after the dispatch loop, so no
+    // token of theirs is still referenced). Without a pidfd, EOF can come well
+    // before the exit; such a child waits in lingering_ instead of blocking
+    // the loop, and is polled again on later turns.
+    void collect_done_pending_() {
+        std::vector<entry_*> done;
+        done.swap(lingering_);
+        ::pthread_mutex_lock(&mu_);
+        done.insert(done.end(), done_.begin(), done_.end());
+        done_.clear();
+        ::pthread_mutex_unlock(&mu_);
+        if (done.empty()) return;
+
+        std::vector<std::pair<entry_*, int> > reaped;
+        for (size_t i = 0; i < done.size(); ++i) {
+            entry_* e = done[i];
+            if (e->open[2]) close_stream_(e, 2);
+            if (e->open[3]) close_stream_(e, 3);
+            int st = 0;
+            if (e->proc->wait(&st, WNOHANG) == 0) { lingering_.push_back(e); continue; }
+            reaped.push_back(std::make_pair(e, st));
+        }
+        ::pthread_mutex_lock(&mu_);
+        for (size_t i = 0; i < reaped.size(); ++i) erase_locked_(reaped[i].first);
+        ::pthread_mutex_unlock(&mu_);
+        for (size_t i = 0; i < reaped.size(); ++i) {
+            entry_* e = reaped[i].first;
+            if (e->h) e->h->on_exit(*e->proc, reaped[i].second);
+            delete e->proc;
+            delete e;
+        }
+    }
+
+    void erase_locked_(entry_* e) {
+        entry_* last = entries_.back();
+        entries_[e->index] = last;
+        last->index = e->index;
+        entries_.pop_back();
+        by_proc_.erase(e->proc);
+    }
+
+    // io_uring: one turn = post new work, submit and wait in a single
+    // io_uring_enter, then handle every completion
+    int run_uring_(int timeout_ms) {
+        std::vector<entry_*> in;
+        ::pthread_mutex_lock(&mu_);
+        in.swap(incoming_);
+        ::pthread_mutex_unlock(&mu_);
+        for (size_t i = 0; i < in.size(); ++i) {
+            entry_* e = in[i];
+            if (e->open[0]) post_stream_(&e->tok[0]);
+            if (e->open[1]) post_stream_(&e->tok[1]);
+            if (e->open[2]) post_poll_(&e->tok[2]);
+            finish_if_done_(e); // No output pipes and no pidfd
+        }
+        wake_throttled_();
+        std::vector<token_*> again;
+        again.swap(repost_);
+        for (size_t i = 0; i < again.size(); ++i) post_stream_(again[i]);
+
+        timeout_ms = turn_timeout_(timeout_ms, !repost_.empty());
+        if (ring_.enter(timeout_ms != 0 ? 1 : 0, timeout_ms) < 0) {
+            fail_("io_uring_enter", errno);
+            return -1;
+        }
+
+        int handled = 0;
+        unsigned head;
+        unsigned n = ring_.cq_ready(&head);
+        for (unsigned i = 0; i < n; ++i, ++head) {
+            const uring_abi_::cqe& c = ring_.cq_at(head);
+            token_* t = reinterpret_cast<token_*>((uintptr_t)c.user_data);
+            int res = c.res;
+            uint32_t flags = c.flags;
+            ++handled;
+            if (t == &wake_tok_) { drain_wake_(); arm_wake_(); continue; }
+            if (t == &cancel_tok_) continue;
+            entry_* e = t->e;
+            --e->posted;
+            if (t->kind == 2) on_pidfd_(e);
+            else if (t->kind == 3) on_stdin_ready_(e, res);
+            else if (e->polled[t->kind]) on_readable_(t);
+            else on_read_done_(t, res, flags);
+            finish_if_done_(e);
+        }
+        ring_.cq_advance(head);
+        collect_done_pending_();
+        return handled;
+    }
+
+    void on_read_done_(token_* t, int res, uint32_t flags) {
+        entry_* e = t->e;
+        if (flags & uring_abi_::CQE_F_BUFFER) {
+            unsigned bid = flags >> uring_abi_::CQE_BUFFER_SHIFT;
+            if (res > 0) deliver_(e, t->kind, ring_.buffer(bid), (size_t)res);
+            ring_.recycle(bid);
+        }
+        if (!e->open[t->kind]) return;
+        if (res > 0) post_read_(t);
+        else if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN) repost_.push_back(t);
+        else close_stream_(e, t->kind); // EOF or error
+    }
+
+    // Streams under an output_limit or with tee sinks must go through
+    // read_stdout()/read_stderr(), which a ring read would bypass
+    static bool reads_via_proc_(const popen3& p, int kind) {
+        return kind == 0 ? (p.out_limit_.active() || p.out_tee_.active())
+                         : (p.err_limit_.active() || p.err_tee_.active());
+    }
+
+    void post_stream_(token_* t) {
+        if (!t->e->polled[t->kind]) { post_read_(t); return; }
+        int fd = (t->kind == 0) ? t->e->proc->stdout_fd() : t->e->proc->stderr_fd();
+        if (!post_pollin_(fd, t)) { repost_.push_back(t); return; }
+        ++t->e->posted;
+    }
+
+    // io_uring, polled stream: read it like epoll's pump_(), then poll again
+    void on_readable_(token_* t) {
+        entry_* e = t->e;
+        if (!e->open[t->kind] || e->paused[t->kind]) return;
+        if (buf_.empty()) buf_.resize(64 * 1024);
+        for (size_t i = 0; i < burst_; ++i) {
+            ssize_t n = (t->kind == 0) ? e->proc->read_stdout(&buf_[0], buf_.size())
+                                       : e->proc->read_stderr(&buf_[0], buf_.size());
+            if (n > 0) { deliver_(e, t->kind, &buf_[0], (size_t)n); continue; }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+                if (!hold_stream_(t, errno)) post_stream_(t);
+                return;
+            }
+            close_stream_(e, t->kind); // EOF or error
+            return;
+        }
+        repost_.push_back(t); // Still busy: give the others a turn first
+    }
+
+    // POLLOUT (or POLLERR once the reader is gone) on stdin; cancelled otherwise
+    void on_stdin_ready_(entry_* e, int res) {
+        e->write_posted = false;
+        if (res < 0) { drop_stdin_(e); return; }
+        flush_stdin_(e);
+    }
+
+    void post_read_(token_* t) {
+        uring_abi_::sqe* s = ring_.get_sqe();
+        if (!s) { repost_.push_back(t); return; }
+        s->opcode = uring_abi_::OP_READ;
+        s->flags = uring_abi_::SQE_BUFFER_SELECT;
+        s->fd = (t->kind == 0) ? t->e->proc->stdout_fd() : t->e->proc->stderr_fd();
+        s->off = (uint64_t)-1;
+        s->len = ring_.bufsize;
+        s->buf_group = 0;
+        s->user_data = (uint64_t)(uintptr_t)t;
+        ++t->e->posted;
+    }
+
+    void post_poll_(token_* t) {
+        if (!post_pollin_(t->e->proc->process_fd(), t)) { t->e->exited = true; return; } // Leave the exit to EOF
+        ++t->e->posted;
+    }
+
+    void post_stdin_poll_(entry_* e) {
+        if (!post_pollin_(e->proc->stdin_fd(), &e->tok[3], POLLOUT)) { drop_stdin_(e); return; }
+        e->write_posted = true;
+        ++e->posted;
+    }
+
+    bool post_pollin_(int fd, token_* t, uint32_t events = POLLIN) {
+        uring_abi_::sqe* s = ring_.get_sqe();
+        if (!s) return false;
+        s->opcode = uring_abi_::OP_POLL_ADD;
+        s->fd = fd;
+        uint32_t ev = events;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        ev = (ev << 16) | (ev >> 16); // poll32_events holds the halfwords swapped
+#endif
+        s->op_flags = ev;
+        s->user_data = (uint64_t)(uintptr_t)t;
+        return true;
+    }
+
+    void post_cancel_(entry_* e) {
+        if (cancel_op_(&e->tok[3])) e->cancel_sent = true;
+    }
+
+    bool cancel_op_(token_* t) {
+        uring_abi_::sqe* s = ring_.get_sqe();
+        if (!s) return false;
+        s->opcode = uring_abi_::OP_ASYNC_CANCEL;
+        s->fd = -1;
+        s->addr = (uint64_t)(uintptr_t)t;
+        s->user_data = (uint64_t)(uintptr_t)&cancel_tok_;
+        return true;
+    }
+
+    // Destruction: cancel the operations still in flight and reap them, so that
+    // no read still fills the buffer pool and no completion names an entry once
+    // those are freed. The children are killed first, so operations the cancel
+    // misses complete on their own.
+    void cancel_inflight_() {
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            entry_* e = entries_[i];
+            for (int k = 0; k < 4 && e->posted > 0; ++k) cancel_op_(&e->tok[k]);
+        }
+        for (int tries = 0; tries < 100; ++tries) {
+            bool busy = false;
+            for (size_t i = 0; i < entries_.size() && !busy; ++i) busy = (entries_[i]->posted > 0);
+            if (!busy || ring_.enter(1, 100) < 0) break;
+            unsigned head;
+            unsigned n = ring_.cq_ready(&head);
+            for (unsigned i = 0; i < n; ++i, ++head) {
+                const uring_abi_::cqe& c = ring_.cq_at(head);
+                token_* t = reinterpret_cast<token_*>((uintptr_t)c.user_data);
+                if (c.flags & uring_abi_::CQE_F_BUFFER) ring_.recycle(c.flags >> uring_abi_::CQE_BUFFER_SHIFT);
+                if (t == &wake_tok_ || t == &cancel_tok_) continue;
+                --t->e->posted;
+            }
+            ring_.cq_advance(head);
+        }
+    }
+
+    void arm_wake_() { post_pollin_(wakefd_, &wake_tok_); }
+
+    void drain_wake_() {
+        uint64_t v;
+        while (::read(wakefd_, &v, sizeof(v)) > 0) {}
+    }
+};
+
+// Thread-per-core sharding of reactor: each shard runs its own loop on its own
+// thread, and spawn() places a new child on the least loaded shard. Callbacks
+// run on the shard's thread.
+class reactor_pool {
+public:
+    explicit reactor_pool(size_t shards = 0, size_t burst = 16, reactor::backend_t backend = reactor::BACKEND_EPOLL)
+    : running_(false) {
+        if (shards == 0) {
+            long n = ::sysconf(_SC_NPROCESSORS_ONLN);
+            shards = (n > 0) ? (size_t)n : 1;
+        }
+        for (size_t i = 0; i < shards; ++i) shards_.push_back(new reactor(burst, backend));
+    }
+
+    ~reactor_pool() {
+        stop();
+        for (size_t i = 0; i < shards_.size(); ++i) delete shards_[i];
+    }
+
+    // Start one thread per shard
+    bool start() {
+        if (running_) return true;
+        threads_.resize(shards_.size());
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (::pthread_create(&threads_[i], 0, &reactor_pool::run_shard_, shards_[i]) != 0) {
+                threads_.resize(i);
+                stop_threads_();
+                return false;
+            }
+        }
+        running_ = true;
+        return true;
+    }
+
+    // Stop and join the shard threads; children stay with their shard
+    void stop() {
+        if (!running_) return;
+        stop_threads_();
+        running_ = false;
+    }
+
+    bool spawn(const std::vector<std::string>& argv, const popen3::options& opt, reactor_handler* h) {
+        return least_loaded_().spawn(argv, opt, h);
+    }
+    bool add(popen3* proc, reactor_handler* h) { return least_loaded_().add(proc, h); }
+
+    size_t shards() const { return shards_.size(); }
+    reactor& shard(size_t i) { return *shards_[i]; }
+    size_t size() const {
+        size_t n = 0;
+        for (size_t i = 0; i < shards_.size(); ++i) n += shards_[i]->size();
+        return n;
+    }
+
+private:
+    std::vector<reactor*> shards_;
+    std::vector<pthread_t> threads_;
+    bool running_;
+
+    reactor_pool(const reactor_pool&);
+    reactor_pool& operator=(const reactor_pool&);
+
+    static void* run_shard_(void* arg) {
+        static_cast<reactor*>(arg)->run(true);
+        return 0;
+    }
+
+    void stop_threads_() {
+        for (size_t i = 0; i < threads_.size(); ++i) shards_[i]->stop();
+        for (size_t i = 0; i < threads_.size(); ++i) ::pthread_join(threads_[i], 0);
+        threads_.clear();
+    }
+
+    reactor& least_loaded_() {
+        size_t best = 0, best_n = (size_t)-1;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            size_t n = shards_[i]->size();
+            if (n < best_n) { best = i; best_n = n; }
+        }
+        return *shards_[best];
+    }
+};
+#endif // defined(__linux__)
+
+// Splits a child's stdout or stderr into lines. next() returns each line
+// (without its delimiter) as a pointer into the reader's own buffer, so no
+// line is copied or allocated; the view is valid until the next call. A line
+// may span any number of reads and grow the buffer without limit; the buffer
+// is reused for every line after that. Delimiters are searched with AVX2 or
+// SSE2 on x86 and memchr elsewhere.
+class line_reader {
+public:
+    enum source_t { STDOUT, STDERR };
+
+    explicit line_reader(popen3& proc, source_t src = STDOUT, char delim = '\n', size_t chunk = 64 * 1024)
+    : proc_(proc), src_(src), delim_(delim), chunk_(chunk ? chunk : 4096),
+      begin_(0), scan_(0), end_(0), eof_(false), errno_(0) {
+        buf_.resize(chunk_);
+    }
+
+    // Next line. Returns false at EOF (after a final unterminated line) or on
+    // a read error; with a non-blocking stream last_errno() is EAGAIN when no
+    // full line is available yet, and a later call resumes where it stopped.
+    bool next(const char** data, size_t* len) {
+        errno_ = 0;
+        for (;;) {
+            const char* base = &buf_[0];
+            const char* hit = find_(base + scan_, base + end_, delim_);
+            if (hit) {
+                *data = base + begin_;
+                *len = (size_t)(hit - *data);
+                begin_ = scan_ = (size_t)(hit - base) + 1;
+                return true;
+            }
+            scan_ = end_; // Never scan the same bytes twice
+            if (eof_) {
+                if (begin_ == end_) return false;
+                *data = base + begin_;
+                *len = end_ - begin_;
+                begin_ = scan_ = end_;
+                return true;
+            }
+            if (!fill_()) return false;
+        }
+    }
+
+#if __cplusplus >= 201703L
+    bool next(std::string_view& line) {
+        const char* p;
+        size_t n;
+        if (!next(&p, &n)) return false;
+        line = std::string_view(p, n);
+        return true;
+    }
+#endif
+
+    bool eof() const { return eof_ && begin_ == end_; }
+    int last_errno() const { return errno_; }
+
+    // Delimiter search used by next(); exposed for callers with their own buffers
+    static const char* find(const char* p, const char* end, char d) { return find_(p, end, d); }
+
+private:
+    popen3& proc_;
+    source_t src_;
+    char delim_;
+    size_t chunk_;
+    std::vector<char> buf_;
+    size_t begin_;  // Start of the unconsumed data
+    size_t scan_;   // Bytes before this have no delimiter
+    size_t end_;    // End of the data read so far
+    bool eof_;
+    int errno_;
+
+    line_reader(const line_reader&);
+    line_reader& operator=(const line_reader&);
+
+    // Read more, first moving the partial line to the front (or growing the
+    // buffer when the partial line already fills it)
+    bool fill_() {
+        if (begin_ > 0) {
+            std::memmove(&buf_[0], &buf_[begin_], end_ - begin_);
+            end_ -= begin_;
+            scan_ -= begin_;
+            begin_ = 0;
+        }
+        if (buf_.size() - end_ < chunk_ / 2) buf_.resize(buf_.size() * 2);
+        for (;;) {
+            ssize_t n = (src_ == STDOUT) ? proc_.read_stdout(&buf_[end_], buf_.size() - end_)
+                                         : proc_.read_stderr(&buf_[end_], buf_.size() - end_);
+            if (n > 0) { end_ += (size_t)n; return true; }
+            if (n == 0) { eof_ = true; return true; }
+            if (errno == EINTR) continue;
+            errno_ = errno;
+            return false;
+        }
+    }
+
+#if defined(TINYPROC_HAS_X86_SIMD)
+    static const char* find_sse2_(const char* p, const char* end, char d) {
+        const __m128i needle = _mm_set1_epi8(d);
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+            if (m) return p + __builtin_ctz(m);
+        }
+        return static_cast<const char*>(std::memchr(p, d, (size_t)(end - p)));
+    }
+
+    __attribute__((target("avx2")))
+    static const char* find_avx2_(const char* p, const char* end, char d) {
+        const __m256i needle = _mm256_set1_epi8(d);
+        for (; end - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+            if (m) return p + __builtin_ctz(m);
+        }
+        return find_sse2_(p, end, d);
+    }
+
+    static const char* find_(const char* p, const char* end, char d) {
+        if (end - p >= 64 && __builtin_cpu_supports("avx2")) return find_avx2_(p, end, d);
+        return find_sse2_(p, end, d);
+    }
+#else
+    static const char* find_(const char* p, const char* end, char d) {
+        if (p >= end) return 0;
+        return static_cast<const char*>(std::memchr(p, d, (size_t)(end - p)));
+    }
+#endif
+};
+
+// Fixed-capacity read buffer over one of a child's output streams (child fd
+// 1: stdout, 2: stderr, others: an extra_fds output). Data is used in place
+// through peek()/consume()/read_until(), and nothing is allocated after
+// construction. On Linux the storage is a memfd mapped twice back to back,
+// so the buffered bytes are contiguous even across the wrap; otherwise the
+// buffer is flat and the unread rest is moved to the front when it runs out
+// of room.
+class buffered_stream {
+public:
+    explicit buffered_stream(size_t capacity = 64 * 1024, bool double_map = true)
+    : proc_(0), child_fd_(1), base_(0), cap_(0), map_size_(0), mirrored_(false),
+      head_(0), tail_(0), scan_(0), eof_(false), errno_(0) {
+        long page = ::sysconf(_SC_PAGESIZE);
+        if (page <= 0) page = 4096;
+        if (capacity == 0) capacity = 1;
+        cap_ = (capacity + (size_t)page - 1) / (size_t)page * (size_t)page;
+        if (double_map) map_mirror_();
+        if (!base_) {
+            void* p = ::mmap(0, cap_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) { errno_ = errno; return; }
+            base_ = static_cast<char*>(p);
+            map_size_ = cap_;
+        }
+    }
+
+    ~buffered_stream() { if (base_) ::munmap(base_, map_size_); }
+
+    bool ok() const { return base_ != 0; }
+
+    // Start reading a (new) child's stream; anything still buffered is dropped
+    void attach(popen3& proc, int child_fd = 1) {
+        proc_ = &proc;
+        child_fd_ = child_fd;
+        reset_();
+    }
+    void detach() { proc_ = 0; reset_(); }
+
+    // Read until at least `want` bytes (at most capacity()) are buffered or
+    // EOF. Returns the bytes buffered, or -1 (last_errno() is EAGAIN for a
+    // non-blocking stream with nothing new).
+    ssize_t fill(size_t want = 1) {
+        errno_ = 0;
+        if (want > cap_) want = cap_;
+        while (size() < want && !eof_) {
+            if (!read_some_()) return -1;
+        }
+        return (ssize_t)size();
+    }
+
+    // Everything buffered, as one contiguous range
+    size_t peek(const char** data) const {
+        *data = base_ + head_;
+        return size();
+    }
+
+    void consume(size_t n) {
+        if (n > size()) n = size();
+        head_ += n;
+        scan_ = (scan_ > n) ? scan_ - n : 0;
+        if (head_ == tail_) {
+            head_ = tail_ = 0;
+        } else if (mirrored_ && head_ >= cap_) {
+            head_ -= cap_;
+            tail_ -= cap_;
+        }
+    }
+
+    // Buffer up to and including the first `delim` and return that range; it
+    // stays buffered until consume(*len). At EOF the unterminated rest is
+    // returned. Returns false at EOF with nothing left, on a read error, or
+    // with ENOBUFS when capacity() fills up without a delimiter.
+    bool read_until(char delim, const char** data, size_t* len) {
+        errno_ = 0;
+        for (;;) {
+            const char* p = base_ + head_;
+            const char* hit = line_reader::find(p + scan_, base_ + tail_, delim);
+            if (hit) {
+                *data = p;
+                *len = (size_t)(hit - p) + 1;
+                scan_ = 0;
+                return true;
+            }
+            scan_ = size();
+            if (eof_) {
+                if (size() == 0) return false;
+                *data = p;
+                *len = size();
+                return true;
+            }
+            if (size() == cap_) { errno_ = ENOBUFS; return false; }
+            if (!read_some_()) return false;
+        }
+    }
+
+    // Copy out up to len bytes: buffered data first, otherwise one read.
+    // Returns 0 at EOF.
+    ssize_t read(void* dst, size_t len) {
+        errno_ = 0;
+        if (size() == 0 && !eof_ && !read_some_()) return -1;
+        size_t n = (len < size()) ? len : size();
+        std::memcpy(dst, base_ + head_, n);
+        consume(n);
+        return (ssize_t)n;
+    }
+
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return cap_; }
+    bool mirrored() const { return mirrored_; }
+    bool eof() const { return eof_ && head_ == tail_; }
+    int last_errno() const { return errno_; }
+
+private:
+    popen3* proc_;
+    int child_fd_;
+    char* base_;
+    size_t cap_, map_size_;
+    bool mirrored_;
+    size_t head_, tail_;  // Unread data is [head_, tail_); mirrored: head_ < cap_
+    size_t scan_;         // Bytes after head_ known to hold no delimiter
+    bool eof_;
+    int errno_;
+
+    buffered_stream(const buffered_stream&);
+    buffered_stream& operator=(const buffered_stream&);
+
+    void reset_() {
+        head_ = tail_ = scan_ = 0;
+        eof_ = false;
+        errno_ = 0;
+    }
+
+    // One read into the free space
+    bool read_some_() {
+        if (!proc_) { errno_ = EBADF; return false; }
+        if (!mirrored_ && head_ > 0 && cap_ - tail_ < cap_ / 2) {
+            std::memmove(base_, base_ + head_, size());
+            tail_ -= head_;
+            head_ = 0;
+        }
+        size_t room = mirrored_ ? cap_ - size() : cap_ - tail_;
+        if (room == 0) { errno_ = ENOBUFS; return false; }
+        for (;;) {
+            ssize_t n = (child_fd_ == 1) ? proc_->read_stdout(base_ + tail_, room)
+                      : (child_fd_ == 2) ? proc_->read_stderr(base_ + tail_, room)
+                      : proc_->read_fd(child_fd_, base_ + tail_, room);
+            if (n > 0) { tail_ += (size_t)n; return true; }
+            if (n == 0) { eof_ = true; return true; }
+            if (errno == EINTR) continue;
+            errno_ = errno;
+            return false;
+        }
+    }
+
+    // Reserve 2 * cap_ of address space and map the same memfd into both halves
+    void map_mirror_() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+        int fd = (int)::syscall(SYS_memfd_create, "tinyproc-ring", 1U /* MFD_CLOEXEC */);
+        if (fd == -1) return;
+        if (::ftruncate(fd, (off_t)cap_) != 0) { ::close(fd); return; }
+        void* r = ::mmap(0, 2 * cap_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) { ::close(fd); return; }
+        char* p = static_cast<char*>(r);
+        if (::mmap(p, cap_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            ::mmap(p + cap_, cap_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            ::munmap(r, 2 * cap_);
+            ::close(fd);
+            return;
+        }
+        ::close(fd);
+        base_ = p;
+        map_size_ = 2 * cap_;
+        mirrored_ = true;
+#endif
+    }
+};
+
+// Keeps detached buffered_streams (with their mappings) for reuse, so a
+// process that runs child after child maps its buffers only once.
+// Thread-safe.
+class buffered_stream_pool {
+public:
+    explicit buffered_stream_pool(size_t capacity = 64 * 1024, bool double_map = true, size_t max_idle = 64)
+    : capacity_(capacity), double_map_(double_map), max_idle_(max_idle) {
+        ::pthread_mutex_init(&mu_, 0);
+        idle_.reserve(max_idle);
+    }
+
+    ~buffered_stream_pool() {
+        for (size_t i = 0; i < idle_.size(); ++i) delete idle_[i];
+        ::pthread_mutex_destroy(&mu_);
+    }
+
+    // A stream attached to proc's child_fd; NULL if no buffer could be mapped
+    buffered_stream* acquire(popen3& proc, int child_fd = 1) {
+        buffered_stream* s = 0;
+        ::pthread_mutex_lock(&mu_);
+        if (!idle_.empty()) { s = idle_.back(); idle_.pop_back(); }
+        ::pthread_mutex_unlock(&mu_);
+        if (!s) {
+            s = new buffered_stream(capacity_, double_map_);
+            if (!s->ok()) { delete s; return 0; }
+        }
+        s->attach(proc, child_fd);
+        return s;
+    }
+
+    // Detach and keep the stream (up to max_idle; the rest are freed)
+    void release(buffered_stream* s) {
+        if (!s) return;
+        s->detach();
+        ::pthread_mutex_lock(&mu_);
+        bool keep = idle_.size() < max_idle_;
+        if (keep) idle_.push_back(s);
+        ::pthread_mutex_unlock(&mu_);
+        if (!keep) delete s;
+    }
+
+    size_t idle() const {
+        ::pthread_mutex_lock(&mu_);
+        size_t n = idle_.size();
+        ::pthread_mutex_unlock(&mu_);
+        return n;
+    }
+
+private:
+    size_t capacity_;
+    bool double_map_;
+    size_t max_idle_;
+    std::vector<buffered_stream*> idle_;
+    mutable pthread_mutex_t mu_;
+
+    buffered_stream_pool(const buffered_stream_pool&);
+    buffered_stream_pool& operator=(const buffered_stream_pool&);
+};
+
+// Length-prefixed frames over a child's stdin/stdout (blocking streams). Each
+// frame is a header -- an unsigned LEB128 varint or a big-endian u32 -- and
+// then that many payload bytes. send() queues small frames and writes them
+// together (flush(), or once batch_bytes are queued); a large payload is
+// written straight from the caller's memory behind the queued bytes. recv()
+// returns each frame in place in the receive buffer, which only grows for
+// frames larger than any seen so far. The child side is popen3_frame.h.
+class framed_channel {
+public:
+    enum framing_t { VARINT, U32 };
+
+    explicit framed_channel(popen3& proc, framing_t framing = VARINT,
+                            size_t max_frame = 64 * 1024 * 1024, size_t batch_bytes = 64 * 1024)
+    : proc_(proc), framing_(framing), max_frame_(max_frame), batch_(batch_bytes),
+      begin_(0), end_(0), last_errno_(0) {
+        out_.reserve(batch_ + 16);
+        in_.resize(64 * 1024);
+    }
+
+    // Queue one frame (written once batch_bytes are queued or on flush())
+    bool send(const void* data, size_t len) {
+        if (len > max_frame_ || (framing_ == U32 && (uint64_t)len > 0xffffffffUL))
+            return fail_("send: frame too large", EMSGSIZE);
+        unsigned char h[10];
+        size_t hl = encode_header(framing_, len, h);
+        out_.append(reinterpret_cast<const char*>(h), hl);
+        if (len >= direct_bytes_) {
+            // Skip the copy: queued frames, this header and the payload in one writev
+            struct iovec iov[2];
+            iov[0].iov_base = &out_[0];
+            iov[0].iov_len = out_.size();
+            iov[1].iov_base = const_cast<void*>(data);
+            iov[1].iov_len = len;
+            bool ok = write_all_(iov, 2);
+            out_.clear();
+            return ok;
+        }
+        out_.append(static_cast<const char*>(data), len);
+        return out_.size() < batch_ || flush();
+    }
+
+    // Write every queued frame
+    bool flush() {
+        if (out_.empty()) return true;
+        struct iovec iov;
+        iov.iov_base = &out_[0];
+        iov.iov_len = out_.size();
+        bool ok = write_all_(&iov, 1);
+        out_.clear();
+        return ok;
+    }
+
+    // Next frame, pointing into the receive buffer; valid until the next
+    // recv(). Returns false at EOF (last_errno() 0) or on error (EPROTO for a
+    // truncated or malformed frame, EMSGSIZE above max_frame).
+    bool recv(const char** data, size_t* len) {
         last_errno_ = 0;
+        for (;;) {
+            size_t avail = end_ - begin_;
+            size_t hl = 0, fl = 0;
+            int r = decode_header(framing_, reinterpret_cast<const unsigned char*>(&in_[begin_]), avail, &hl, &fl);
+            if (r < 0) return fail_("recv: malformed frame header", EPROTO);
+            if (r > 0 && fl > max_frame_) return fail_("recv: frame too large", EMSGSIZE);
+            if (r > 0 && avail - hl >= fl) {
+                *data = &in_[begin_ + hl];
+                *len = fl;
+                begin_ += hl + fl;
+                if (begin_ == end_) begin_ = end_ = 0;
+                return true;
+            }
+            if (!fill_(r > 0 ? hl + fl : avail + 1)) return false;
+        }
     }
-    bool fail_perror_(const char* where) {
+
+#if __cplusplus >= 201703L
+    bool recv(std::string_view& frame) {
+        const char* p;
+        size_t n;
+        if (!recv(&p, &n)) return false;
+        frame = std::string_view(p, n);
+        return true;
+    }
+#endif
+
+    // send + flush + recv
+    bool call(const void* req, size_t len, const char** resp, size_t* resp_len) {
+        return send(req, len) && flush() && recv(resp, resp_len);
+    }
+
+    size_t queued() const { return out_.size(); }
+    const std::string& last_error() const { return last_error_msg_; }
+    int last_errno() const { return last_errno_; }
+
+    // Header codec (mirrored by popen3_frame.h). encode writes at most 10
+    // bytes; decode returns 1 with the header and payload lengths, 0 if more
+    // bytes are needed, -1 if the header is malformed.
+    static size_t encode_header(framing_t framing, size_t len, unsigned char* out) {
+        if (framing == U32) {
+            out[0] = (unsigned char)(len >> 24);
+            out[1] = (unsigned char)(len >> 16);
+            out[2] = (unsigned char)(len >> 8);
+            out[3] = (unsigned char)len;
+            return 4;
+        }
+        size_t n = 0;
+        uint64_t v = len;
+        while (v >= 0x80) { out[n++] = (unsigned char)(v | 0x80); v >>= 7; }
+        out[n++] = (unsigned char)v;
+        return n;
+    }
+
+    static int decode_header(framing_t framing, const unsigned char* p, size_t avail, size_t* hlen, size_t* len) {
+        if (framing == U32) {
+            if (avail < 4) return 0;
+            *hlen = 4;
+            *len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+            return 1;
+        }
+        uint64_t v = 0;
+        for (size_t i = 0; i < 10; ++i) {
+            if (i == avail) return 0;
+            v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+            if (!(p[i] & 0x80)) {
+                if ((uint64_t)(size_t)v != v) return -1;
+                *hlen = i + 1;
+                *len = (size_t)v;
+                return 1;
+            }
+        }
+        return -1;
+    }
+
+private:
+    static const size_t direct_bytes_ = 16 * 1024; // Payloads from this size are not copied
+
+    popen3& proc_;
+    framing_t framing_;
+    size_t max_frame_, batch_;
+    std::string out_;
+    std::vector<char> in_;
+    size_t begin_, end_;
+    std::string last_error_msg_;
+    int last_errno_;
+
+    framed_channel(const framed_channel&);
+    framed_channel& operator=(const framed_channel&);
+
+    bool fail_(const char* what, int e) {
         char buf[256];
-        std::snprintf(buf, sizeof(buf), "%s: %s", where, std::strerror(errno));
-        set_last_error_(buf, errno);
+        std::snprintf(buf, sizeof(buf), "%s: %s", what, std::strerror(e));
+        last_error_msg_ = buf;
+        last_errno_ = e;
         return false;
     }
 
-    static void safe_close_(int fd, bool do_close) {
-        if (do_close && fd >= 0) { ::close(fd); }
-    }
-    static void safe_close_pair_(int p[2]) {
-        if (p[0] != -1) ::close(p[0]);
-        if (p[1] != -1) ::close(p[1]);
-        p[0] = p[1] = -1;
+    bool write_all_(const struct iovec* iov, int cnt) {
+        size_t total = 0;
+        for (int i = 0; i < cnt; ++i) total += iov[i].iov_len;
+        popen3::sigpipe_guard_ guard;
+        ssize_t n = proc_.writev_stdin(iov, cnt);
+        if (n < 0) return fail_("send", errno);
+        if ((size_t)n != total) return fail_("send: short write (non-blocking stdin?)", EAGAIN);
+        return true;
     }
-    static int set_cloexec_(int fd) {
-        if (fd < 0) return -1;
-        int flags = ::fcntl(fd, F_GETFD);
-        if (flags == -1) return -1;
-        return ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+
+    // Read until `need` bytes of the current frame are buffered
+    bool fill_(size_t need) {
+        if (begin_ > 0 && in_.size() - begin_ < need) {
+            std::memmove(&in_[0], &in_[begin_], end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (in_.size() - begin_ < need) in_.resize(std::max(need + begin_, in_.size() * 2));
+        for (;;) {
+            ssize_t n = proc_.read_stdout(&in_[end_], in_.size() - end_);
+            if (n > 0) { end_ += (size_t)n; return true; }
+            if (n == 0) {
+                if (end_ != begin_) return fail_("recv: truncated frame", EPROTO);
+                return false;
+            }
+            if (errno == EINTR) continue;
+            return fail_("recv", errno);
+        }
     }
-    static int set_nonblock_(int fd, bool on) {
-        if (fd < 0) return -1;
-        int flags = ::fcntl(fd, F_GETFL);
-        if (flags == -1) return -1;
-        if (on) flags |= O_NONBLOCK;
-        else    flags &= ~O_NONBLOCK;
-        return ::fcntl(fd, F_SETFL, flags);
+};
+
+// Captures a child's output with bounded memory: the first ram_bytes stay on
+// the heap, and everything after that goes to an unlinked temporary file (or
+// a memfd on Linux). While spilling from a pipe, data is spliced into the
+// file without passing through user space. view() gives one contiguous,
+// read-only mapping of the whole capture, so a huge output costs page cache
+// instead of heap.
+class output_capture {
+public:
+    enum spill_t { SPILL_TMPFILE, SPILL_MEMFD };
+
+    // dir: where SPILL_TMPFILE creates its file (default: $TMPDIR, then /tmp)
+    explicit output_capture(size_t ram_bytes = 8 * 1024 * 1024, spill_t spill = SPILL_TMPFILE, const char* dir = 0)
+    : limit_(ram_bytes), used_(0), spill_(spill), dir_(dir ? dir : ""), fd_(-1), total_(0),
+      head_in_file_(false), map_(0), map_len_(0), last_errno_(0) {}
+
+    ~output_capture() {
+        unmap_();
+        if (fd_ != -1) ::close(fd_);
     }
-    static ssize_t retry_eintr_read_(int fd, void* buf, size_t len) {
+
+    // Read child_fd's stream (1: stdout, 2: stderr, others: an extra_fds
+    // output) until EOF. Returns false on error; with a non-blocking stream
+    // last_errno() is EAGAIN and a later call continues.
+    bool drain(popen3& proc, int child_fd = 1) {
         for (;;) {
-            ssize_t n = ::read(fd, buf, len);
-            if (n < 0 && errno == EINTR) continue;
-            return n;
+            ssize_t n = read_from(proc, child_fd);
+            if (n == 0) return true;
+            if (n < 0) return false;
         }
     }
-    static ssize_t retry_eintr_write_(int fd, const void* buf, size_t len) {
-        const char* p = static_cast<const char*>(buf);
-        size_t left = len;
-        while (left) {
-            ssize_t n = ::write(fd, p, left);
-            if (n < 0) {
-                if (errno == EINTR) continue;
-                return n; // Error
+
+    // One read (or splice) from child_fd's stream: bytes captured, 0 at EOF, -1 on error
+    ssize_t read_from(popen3& proc, int child_fd = 1) {
+        last_errno_ = 0;
+        if (fd_ == -1 && used_ < limit_) {
+            size_t room = limit_ - used_;
+            if (room > 256 * 1024) room = 256 * 1024;
+            if (ram_.size() < used_ + room) {
+                size_t cap = std::max(ram_.size() * 2, used_ + room);
+                ram_.resize(std::min(cap, limit_));
             }
-            left -= (size_t)n;
-            p += n;
+            ssize_t n = stream_read_(proc, child_fd, &ram_[used_], room);
+            if (n > 0) { used_ += (size_t)n; total_ += (uint64_t)n; }
+            if (n < 0) last_errno_ = errno;
+            return n;
         }
-        return (ssize_t)len;
+        if (scratch_.empty()) scratch_.resize(256 * 1024);
+        if (fd_ == -1) {
+            // The head is full: create the spill file once data goes past it, not
+            // on the read that only finds EOF
+            ssize_t n = stream_read_(proc, child_fd, &scratch_[0], scratch_.size());
+            if (n < 0) last_errno_ = errno;
+            if (n > 0 && !(open_spill_() && write_file_(&scratch_[0], (size_t)n))) return -1;
+            return n;
+        }
+#if defined(__linux__)
+        int src = raw_fd_(proc, child_fd);
+        if (src != -1) {
+            off_t off = (off_t)total_;
+            ssize_t n;
+            do { n = ::splice(src, 0, fd_, &off, 1 << 20, SPLICE_F_MOVE); } while (n < 0 && errno == EINTR);
+            if (n > 0) { total_ += (uint64_t)n; return n; }
+            if (n == 0) return 0;
+            if (errno != EINVAL && errno != ENOSYS) { fail_(errno); return -1; }
+            // The file system cannot splice; copy instead
+        }
+#endif
+        ssize_t n = stream_read_(proc, child_fd, &scratch_[0], scratch_.size());
+        if (n < 0) last_errno_ = errno;
+        if (n > 0 && !write_file_(&scratch_[0], (size_t)n)) return -1;
+        return n;
     }
-    static ssize_t read_full_errno_(int fd, void* buf, size_t len) {
-        // On successful exec, CLOEXEC should cause an immediate EOF (0).
-        // On failure, errno (as int) is written.
-        char* p = static_cast<char*>(buf);
-        size_t got = 0;
-        while (got < len) {
-            ssize_t n = ::read(fd, p + got, len - got);
-            if (n == 0) break;           // EOF
-            if (n < 0) {
-                if (errno == EINTR) continue;
-                return n;
+
+    // Capture bytes obtained elsewhere (e.g. reactor_handler::on_stdout)
+    bool append(const char* data, size_t len) {
+        last_errno_ = 0;
+        if (fd_ == -1) {
+            size_t take = std::min(len, limit_ - used_);
+            if (take) {
+                if (ram_.size() < used_ + take) ram_.resize(std::min(std::max(ram_.size() * 2, used_ + take), limit_));
+                std::memcpy(&ram_[used_], data, take);
+                used_ += take;
+                total_ += (uint64_t)take;
+                data += take;
+                len -= take;
             }
-            got += (size_t)n;
+            if (!len) return true;
         }
-        return (ssize_t)got;
+        return open_spill_() && write_file_(data, len);
     }
-    static void write_errno_and_exit_(int fd, const char* where) {
-        (void)where; // where is available for debugging if needed
-        int e = errno;
-        // Best effort: write errno back to the parent
-        (void)::write(fd, &e, sizeof(e));
-        _exit(127);
+
+    uint64_t size() const { return total_; }
+    bool spilled() const { return fd_ != -1; }
+    size_t ram_bytes() const { return head_in_file_ ? 0 : used_; } // Heap in use
+    int last_errno() const { return last_errno_; }
+
+    // The whole capture as one read-only range, valid until the next call
+    // that adds data. Without a spill this is the heap buffer; otherwise the
+    // heap part is moved into the file once and the file is mapped.
+    bool view(const char** data, size_t* len) {
+        last_errno_ = 0;
+        if (fd_ == -1) {
+            *data = used_ ? &ram_[0] : "";
+            *len = used_;
+            return true;
+        }
+        if (!head_in_file_) {
+            if (used_ && !pwrite_full_(&ram_[0], used_, 0)) return false;
+            std::vector<char>().swap(ram_);
+            head_in_file_ = true;
+        }
+        if ((uint64_t)(size_t)total_ != total_) return fail_(EOVERFLOW);
+        if (total_ == 0) { // mmap() rejects an empty range
+            *data = "";
+            *len = 0;
+            return true;
+        }
+        if (!map_ || map_len_ != (size_t)total_) {
+            unmap_();
+            void* p = ::mmap(0, (size_t)total_, PROT_READ, MAP_SHARED, fd_, 0);
+            if (p == MAP_FAILED) return fail_(errno);
+            map_ = static_cast<char*>(p);
+            map_len_ = (size_t)total_;
+        }
+        *data = map_;
+        *len = map_len_;
+        return true;
     }
-    static void split_kv_(const std::string& kv, std::string& k, std::string& v) {
-        std::string::size_type pos = kv.find('=');
-        if (pos == std::string::npos) {
-            k = kv; v = "";
-        } else {
-            k = kv.substr(0, pos);
-            v = kv.substr(pos + 1);
+
+    // Copy up to len bytes starting at offset (pread-like, no mapping needed).
+    // Returns the bytes copied, 0 past the end, -1 on error.
+    ssize_t read_at(uint64_t offset, void* buf, size_t len) {
+        last_errno_ = 0;
+        if (offset >= total_) return 0;
+        if ((uint64_t)len > total_ - offset) len = (size_t)(total_ - offset);
+        if (!head_in_file_ && offset < used_) {
+            size_t n = std::min(len, used_ - (size_t)offset);
+            std::memcpy(buf, &ram_[(size_t)offset], n);
+            return (ssize_t)n;
+        }
+        ssize_t n;
+        do { n = ::pread(fd_, buf, len, (off_t)offset); } while (n < 0 && errno == EINTR);
+        if (n < 0) { fail_(errno); return -1; }
+        return n;
+    }
+
+private:
+    size_t limit_;
+    std::vector<char> ram_;   // Heap head; only [0, used_) is data
+    size_t used_;
+    spill_t spill_;
+    std::string dir_;
+    int fd_;                  // Spill file; data from offset limit_ (the head goes to [0, limit_) in view())
+    uint64_t total_;
+    bool head_in_file_;
+    std::vector<char> scratch_;
+    char* map_;
+    size_t map_len_;
+    int last_errno_;
+
+    output_capture(const output_capture&);
+    output_capture& operator=(const output_capture&);
+
+    bool fail_(int e) {
+        last_errno_ = e;
+        errno = e;
+        return false;
+    }
+
+    void unmap_() {
+        if (map_) ::munmap(map_, map_len_);
+        map_ = 0;
+        map_len_ = 0;
+    }
+
+    static ssize_t stream_read_(popen3& proc, int child_fd, char* p, size_t n) {
+        for (;;) {
+            ssize_t r = (child_fd == 1) ? proc.read_stdout(p, n)
+                      : (child_fd == 2) ? proc.read_stderr(p, n)
+                      : proc.read_fd(child_fd, p, n);
+            if (r >= 0 || errno != EINTR) return r;
+        }
+    }
+
+    // The pipe to splice from, unless read_*() must see the data (tee sinks, limits)
+    static int raw_fd_(popen3& proc, int child_fd) {
+        if (child_fd == 1) return (proc.out_tee_.active() || proc.out_limit_.active()) ? -1 : proc.stdout_fd();
+        if (child_fd == 2) return (proc.err_tee_.active() || proc.err_limit_.active()) ? -1 : proc.stderr_fd();
+        return proc.parent_fd(child_fd);
+    }
+
+    bool open_spill_() {
+        if (fd_ != -1) return true;
+#if defined(__linux__) && defined(SYS_memfd_create)
+        if (spill_ == SPILL_MEMFD) fd_ = (int)::syscall(SYS_memfd_create, "tinyproc-capture", 1U /* MFD_CLOEXEC */);
+#endif
+        if (fd_ == -1) fd_ = popen3::open_tmpfile_(dir_, "tinyproc-capture");
+        if (fd_ == -1) return fail_(errno);
+        // Spilled data starts after the room reserved for the heap head
+        total_ = limit_;
+        return true;
+    }
+
+    bool write_file_(const char* p, size_t n) {
+        if (!pwrite_full_(p, n, total_)) return false;
+        total_ += (uint64_t)n;
+        return true;
+    }
+
+    bool pwrite_full_(const char* p, size_t n, uint64_t off) {
+        while (n) {
+            ssize_t w = ::pwrite(fd_, p, n, (off_t)off);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return fail_(errno);
+            }
+            p += w;
+            n -= (size_t)w;
+            off += (uint64_t)w;
         }
+        return true;
     }
 };
 
@@ -1193,4 +5848,148 @@ private:
 
 #endif // defined(_WIN32)
 
+// ---- Common to both platforms ----
+#include <streambuf>
+
+namespace tinyproc {
+
+// std::streambuf over one of a popen3's pipes. Characters move through the
+// get/put areas without virtual calls; underflow()/overflow() run once per
+// buffer. xsgetn()/xsputn() requests of at least a buffer's size bypass the
+// buffer and go straight to read_stdout()/write_stdin(). Input reports EOF
+// when the read returns 0, so the pipe must be blocking.
+class pipe_streambuf : public std::streambuf {
+public:
+    enum channel_t { STDIN, STDOUT, STDERR };
+
+    pipe_streambuf(popen3& proc, channel_t ch, size_t buffer_size = 0)
+    : proc_(proc), ch_(ch), buf_(buffer_size ? buffer_size : 64 * 1024) {
+        if (ch_ == STDIN) setp(&buf_[0], &buf_[0] + buf_.size());
+        else setg(&buf_[0], &buf_[0], &buf_[0]);
+    }
+
+    ~pipe_streambuf() { if (ch_ == STDIN) flush_(); }
+
+protected:
+    int_type underflow() {
+        if (ch_ == STDIN) return traits_type::eof();
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        ssize_t n = read_(&buf_[0], buf_.size());
+        if (n <= 0) return traits_type::eof();
+        setg(&buf_[0], &buf_[0], &buf_[0] + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char* s, std::streamsize n) {
+        if (ch_ == STDIN) return 0;
+        std::streamsize done = 0;
+        while (done < n) {
+            std::streamsize avail = egptr() - gptr();
+            if (avail > 0) {
+                std::streamsize take = (avail < n - done) ? avail : n - done;
+                std::memcpy(s + done, gptr(), (size_t)take);
+                gbump((int)take);
+                done += take;
+                continue;
+            }
+            if ((size_t)(n - done) >= buf_.size()) {
+                ssize_t r = read_(s + done, (size_t)(n - done));
+                if (r <= 0) break;
+                done += r;
+                continue;
+            }
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+        }
+        return done;
+    }
+
+    int_type overflow(int_type c) {
+        if (ch_ != STDIN || !flush_()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) {
+        if (ch_ != STDIN) return 0;
+        if (n < epptr() - pptr()) {
+            std::memcpy(pptr(), s, (size_t)n);
+            pbump((int)n);
+            return n;
+        }
+        if (!flush_()) return 0;
+        if ((size_t)n >= buf_.size()) return write_all_(s, (size_t)n) ? n : 0;
+        std::memcpy(pptr(), s, (size_t)n);
+        pbump((int)n);
+        return n;
+    }
+
+    int sync() { return (ch_ != STDIN || flush_()) ? 0 : -1; }
+
+private:
+    popen3& proc_;
+    channel_t ch_;
+    std::vector<char> buf_;
+
+    pipe_streambuf(const pipe_streambuf&);
+    pipe_streambuf& operator=(const pipe_streambuf&);
+
+    ssize_t read_(char* p, size_t n) {
+        return (ch_ == STDOUT) ? proc_.read_stdout(p, n) : proc_.read_stderr(p, n);
+    }
+
+    bool write_all_(const char* p, size_t n) {
+        while (n) {
+            ssize_t w = proc_.write_stdin(p, n);
+            if (w <= 0) return false;
+            p += w;
+            n -= (size_t)w;
+        }
+        return true;
+    }
+
+    // Write the put area; it is emptied even on failure (the stream goes bad)
+    bool flush_() {
+        size_t n = (size_t)(pptr() - pbase());
+        bool ok = (n == 0) || write_all_(pbase(), n);
+        setp(&buf_[0], &buf_[0] + buf_.size());
+        return ok;
+    }
+};
+
+class pipe_istream : public std::istream {
+public:
+    pipe_istream(popen3& proc, pipe_streambuf::channel_t ch, size_t buffer_size = 0)
+    : std::istream(0), buf_(proc, ch, buffer_size) { rdbuf(&buf_); }
+private:
+    pipe_streambuf buf_;
+};
+
+class pipe_ostream : public std::ostream {
+public:
+    pipe_ostream(popen3& proc, size_t buffer_size = 0)
+    : std::ostream(0), buf_(proc, pipe_streambuf::STDIN, buffer_size) { rdbuf(&buf_); }
+private:
+    pipe_streambuf buf_;
+};
+
+inline std::ostream& popen3::stdin_stream(size_t buffer_size) {
+    if (!in_stream_) in_stream_ = new pipe_ostream(*this, buffer_size);
+    return *in_stream_;
+}
+
+inline std::istream& popen3::stdout_stream(size_t buffer_size) {
+    if (!out_stream_) out_stream_ = new pipe_istream(*this, pipe_streambuf::STDOUT, buffer_size);
+    return *out_stream_;
+}
+
+inline std::istream& popen3::stderr_stream(size_t buffer_size) {
+    if (!err_stream_) err_stream_ = new pipe_istream(*this, pipe_streambuf::STDERR, buffer_size);
+    return *err_stream_;
+}
+
+} // namespace tinyproc
+
 #endif // TINYPROC_POPEN3_HPP
@@ -0,0 +1,158 @@
+#ifndef TINYPROC_POPEN3_FRAME_H
+#define TINYPROC_POPEN3_FRAME_H
+
+/*
+ * Child side of tinyproc::framed_channel (popen3.hpp): read request frames
+ * from stdin and write reply frames to stdout. Plain C99 (also valid C++),
+ * POSIX only, no dependencies.
+ *
+ * A frame is a header -- an unsigned LEB128 varint (TPF_VARINT) or a
+ * big-endian u32 (TPF_U32) -- followed by that many payload bytes.
+ *
+ *   tpf_reader r;
+ *   const char* req; size_t len;
+ *   tpf_reader_init(&r, 0, TPF_VARINT, 1 << 26);
+ *   while (tpf_read(&r, &req, &len) == 1)
+ *       tpf_write(1, TPF_VARINT, req, len);   // echo
+ *   tpf_reader_free(&r);
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define TPF_VARINT 0
+#define TPF_U32    1
+
+typedef struct tpf_reader {
+    int fd;
+    int framing;
+    size_t max_frame;
+    char* buf;
+    size_t cap, begin, end;
+} tpf_reader;
+
+/* Writes at most 10 bytes; returns the header length */
+static inline size_t tpf_encode_header(int framing, size_t len, unsigned char* out) {
+    size_t n = 0;
+    uint64_t v = len;
+    if (framing == TPF_U32) {
+        out[0] = (unsigned char)(len >> 24);
+        out[1] = (unsigned char)(len >> 16);
+        out[2] = (unsigned char)(len >> 8);
+        out[3] = (unsigned char)len;
+        return 4;
+    }
+    while (v >= 0x80) { out[n++] = (unsigned char)(v | 0x80); v >>= 7; }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/* 1: header decoded, 0: need more bytes, -1: malformed */
+static inline int tpf_decode_header(int framing, const unsigned char* p, size_t avail, size_t* hlen, size_t* len) {
+    uint64_t v = 0;
+    size_t i;
+    if (framing == TPF_U32) {
+        if (avail < 4) return 0;
+        *hlen = 4;
+        *len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+        return 1;
+    }
+    for (i = 0; i < 10; ++i) {
+        if (i == avail) return 0;
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            if ((uint64_t)(size_t)v != v) return -1;
+            *hlen = i + 1;
+            *len = (size_t)v;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+static inline void tpf_reader_init(tpf_reader* r, int fd, int framing, size_t max_frame) {
+    r->fd = fd;
+    r->framing = framing;
+    r->max_frame = max_frame;
+    r->buf = 0;
+    r->cap = r->begin = r->end = 0;
+}
+
+static inline void tpf_reader_free(tpf_reader* r) {
+    free(r->buf);
+    r->buf = 0;
+    r->cap = r->begin = r->end = 0;
+}
+
+/* 1: data and len hold the next frame (valid until the next call), 0: EOF,
+   -1: error with errno set (EPROTO: truncated or malformed, EMSGSIZE: over max_frame) */
+static inline int tpf_read(tpf_reader* r, const char** data, size_t* len) {
+    for (;;) {
+        size_t avail = r->end - r->begin, hl = 0, fl = 0, need;
+        int d = tpf_decode_header(r->framing, (const unsigned char*)r->buf + r->begin, avail, &hl, &fl);
+        ssize_t n;
+        if (d < 0) { errno = EPROTO; return -1; }
+        if (d > 0 && (fl > r->max_frame || fl > (size_t)-1 - hl)) { errno = EMSGSIZE; return -1; }
+        if (d > 0 && avail - hl >= fl) {
+            *data = r->buf + r->begin + hl;
+            *len = fl;
+            r->begin += hl + fl;
+            return 1;
+        }
+        need = (d > 0) ? hl + fl : avail + 1;
+        if (r->begin > 0 && r->cap - r->begin < need) {
+            memmove(r->buf, r->buf + r->begin, avail);
+            r->end = avail;
+            r->begin = 0;
+        }
+        if (r->cap - r->begin < need || r->end == r->cap) {
+            size_t cap = r->cap ? r->cap * 2 : 64 * 1024;
+            char* b;
+            if (cap < r->begin + need) cap = r->begin + need;
+            b = (char*)realloc(r->buf, cap);
+            if (!b) { errno = ENOMEM; return -1; }
+            r->buf = b;
+            r->cap = cap;
+        }
+        n = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (n > 0) { r->end += (size_t)n; continue; }
+        if (n == 0) {
+            if (r->end != r->begin) { errno = EPROTO; return -1; }
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+/* Write one frame (header and payload in one writev); 0 or -1 with errno
+   (EMSGSIZE: over 0xffffffff bytes with TPF_U32) */
+static inline int tpf_write(int fd, int framing, const void* data, size_t len) {
+    unsigned char h[10];
+    struct iovec iov[2];
+    int i = 0;
+    if (framing == TPF_U32 && (uint64_t)len > 0xffffffffu) { errno = EMSGSIZE; return -1; }
+    iov[0].iov_base = h;
+    iov[0].iov_len = tpf_encode_header(framing, len, h);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    while (i < 2) {
+        ssize_t n = writev(fd, iov + i, 2 - i);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (i < 2 && (size_t)n >= iov[i].iov_len) { n -= (ssize_t)iov[i].iov_len; ++i; }
+        if (i < 2) {
+            iov[i].iov_base = (char*)iov[i].iov_base + n;
+            iov[i].iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+#endif /* TINYPROC_POPEN3_FRAME_H */